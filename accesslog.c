@@ -0,0 +1,263 @@
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "./utils.h"
+#include "./metrics.h"
+#include "./accesslog.h"
+
+#define WRITER_BUFFER 65536
+#define WRITER_PAUSE  5000000   // nanoseconds, when all the rings are empty
+
+// The producer and the consumer indexes live on distinct cache lines.
+// The producer keeps a copy of the consumer index and only reloads it
+// when the ring looks full.
+struct access_ring_s
+{
+    struct access_ring_s *next;  // registered in the writer
+    struct access_s *tab;
+    unsigned int mask;
+    int closed;
+    uint64_t head __attribute__ ((aligned (METRICS_ALIGN)));   // consumer
+    uint64_t tail __attribute__ ((aligned (METRICS_ALIGN)));   // producer
+    uint64_t head_seen;
+};
+
+enum dest_e
+{ DEST_LOG = 0, DEST_SYSLOG, DEST_FILE };
+
+static enum dest_e dest = DEST_LOG;
+static int dest_fd = -1;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct access_ring_s *rings = NULL;
+static pthread_t writer;
+static int writer_started = 0;
+static volatile int writer_stopping = 0;
+
+static struct
+{
+    char buf[WRITER_BUFFER];
+    size_t len;
+} out;
+
+int
+access_init (const char *d)
+{
+    if (!d) {
+        dest = DEST_LOG;
+        return 1;
+    }
+    if (!strcmp (d, "syslog")) {
+        dest = DEST_SYSLOG;
+        return 1;
+    }
+    dest_fd = open (d, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (dest_fd < 0)
+        return 0;
+    dest = DEST_FILE;
+    return 1;
+}
+
+static void
+_flush (void)
+{
+    int fd = (dest == DEST_FILE) ? dest_fd : 2;
+
+    for (size_t off = 0; off < out.len;) {
+        ssize_t rc = write (fd, out.buf + off, out.len - off);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        off += rc;
+    }
+    out.len = 0;
+}
+
+// The milestones are printed in microseconds since the accept, "-" if
+// never reached.
+static void
+_format (const struct access_s *a, int64_t wall_offset)
+{
+    char line[512], sfrom[64], sto[64], sfailed[64], d[5][24];
+    const uint64_t stamps[5] = {
+        a->popped, a->connected, a->first_up, a->first_down, a->closed
+    };
+    const char *reason = a->reason ? metrics_abort_names[a->reason - 1]
+        : "closed";
+    uint64_t when = a->closed + wall_offset;
+    int len;
+
+    sockaddr_dump ((const struct sockaddr *) &a->from, sfrom, sizeof (sfrom));
+    sockaddr_dump ((const struct sockaddr *) &a->to, sto, sizeof (sto));
+    if (a->failovers)
+        sockaddr_dump ((const struct sockaddr *) &a->failed, sfailed,
+            sizeof (sfailed));
+    else
+        strcpy (sfailed, "-");
+    for (int i = 0; i < 5; ++i) {
+        if (stamps[i])
+            snprintf (d[i], sizeof (d[i]), "%llu",
+                (unsigned long long) (stamps[i] - a->accepted));
+        else
+            strcpy (d[i], "-");
+    }
+    len = snprintf (line, sizeof (line),
+        "%llu.%06llu %u %llu %s -> %s %s %d %s %s %s %s %s %llu %llu"
+        " %u %s %d\n",
+        (unsigned long long) (when / 1000000),
+        (unsigned long long) (when % 1000000), a->worker,
+        (unsigned long long) a->id, sfrom, sto, reason, a->err,
+        d[0], d[1], d[2], d[3], d[4],
+        (unsigned long long) a->bytes_up, (unsigned long long) a->bytes_down,
+        a->failovers, sfailed, a->failed_err);
+    if (len <= 0)
+        return;
+    if ((size_t) len >= sizeof (line))
+        len = sizeof (line) - 1;
+
+    if (dest == DEST_SYSLOG
+        || (dest == DEST_LOG && (main_flags & MF_DAEMONIZED))) {
+        syslog (LOG_INFO, "%.*s", len - 1, line);
+        return;
+    }
+    if (out.len + len > sizeof (out.buf))
+        _flush ();
+    memcpy (out.buf + out.len, line, len);
+    out.len += len;
+}
+
+// Drain what the rings hold at this time, and free the rings closed and
+// empty. Returns how many records have been written.
+static unsigned int
+_drain (void)
+{
+    struct access_ring_s **pr, *r;
+    unsigned int count = 0;
+    struct timespec rt, mt;
+    int64_t wall_offset;
+
+    clock_gettime (CLOCK_REALTIME, &rt);
+    clock_gettime (CLOCK_MONOTONIC, &mt);
+    wall_offset = ((int64_t) rt.tv_sec - mt.tv_sec) * 1000000
+        + (rt.tv_nsec - mt.tv_nsec) / 1000;
+
+    pthread_mutex_lock (&lock);
+    for (pr = &rings; (r = *pr) != NULL;) {
+        int closed = __atomic_load_n (&r->closed, __ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+        uint64_t head = r->head;
+
+        for (; head != tail; ++head, ++count)
+            _format (r->tab + (head & r->mask), wall_offset);
+        __atomic_store_n (&r->head, head, __ATOMIC_RELEASE);
+
+        if (closed && head == __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE)) {
+            *pr = r->next;
+            free (r->tab);
+            free (r);
+        }
+        else {
+            pr = &r->next;
+        }
+    }
+    pthread_mutex_unlock (&lock);
+
+    _flush ();
+    return count;
+}
+
+static void *
+_writer (void *p)
+{
+    struct timespec pause = { 0, WRITER_PAUSE };
+    sigset_t all;
+
+    (void) p;
+    sigfillset (&all);
+    pthread_sigmask (SIG_BLOCK, &all, NULL);
+    for (;;) {
+        int stopping = writer_stopping;
+
+        if (_drain () > 0)
+            continue;
+        if (stopping)
+            break;
+        nanosleep (&pause, NULL);
+    }
+    return NULL;
+}
+
+struct access_ring_s *
+access_open (unsigned int size)
+{
+    struct access_ring_s *r;
+    unsigned int sz;
+
+    for (sz = 1; sz < size; sz <<= 1);
+    if (0 != posix_memalign ((void **) &r, METRICS_ALIGN, sizeof (*r)))
+        return NULL;
+    memset (r, 0, sizeof (*r));
+    r->mask = sz - 1;
+    if (!(r->tab = calloc (sz, sizeof (struct access_s)))) {
+        free (r);
+        return NULL;
+    }
+
+    pthread_mutex_lock (&lock);
+    r->next = rings;
+    rings = r;
+    if (!writer_started) {
+        if (0 != pthread_create (&writer, NULL, _writer, NULL))
+            LOG ("access writer failed : (%d) %s", errno, strerror (errno));
+        else
+            writer_started = 1;
+    }
+    pthread_mutex_unlock (&lock);
+    return r;
+}
+
+void
+access_close (struct access_ring_s *r)
+{
+    if (r)
+        __atomic_store_n (&r->closed, 1, __ATOMIC_RELEASE);
+}
+
+int
+access_push (struct access_ring_s *r, const struct access_s *a)
+{
+    uint64_t tail = r->tail;
+
+    if (tail - r->head_seen > r->mask) {
+        r->head_seen = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+        if (tail - r->head_seen > r->mask)
+            return 0;
+    }
+    r->tab[tail & r->mask] = *a;
+    __atomic_store_n (&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void
+access_fini (void)
+{
+    pthread_mutex_lock (&lock);
+    int started = writer_started;
+
+    writer_started = 0;
+    pthread_mutex_unlock (&lock);
+
+    if (started) {
+        writer_stopping = 1;
+        pthread_join (writer, NULL);
+        writer_stopping = 0;
+    }
+    if (dest_fd >= 0) {
+        close (dest_fd);
+        dest_fd = -1;
+    }
+}
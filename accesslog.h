@@ -0,0 +1,49 @@
+#ifndef LB_ACCESSLOG_H
+#define LB_ACCESSLOG_H 1
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Access records are pushed by the event loops as fixed-size binary
+// entries in a ring of their own, and a background thread formats and
+// writes them by batches. Each ring has a single producer (its event
+// loop) and a single consumer (the writer), nothing is locked on the hot
+// path. A record that does not fit in a full ring is dropped.
+
+struct access_s
+{
+    uint64_t id;
+    struct sockaddr_in6 from, to;
+    // Monotonic, in microseconds, 0 for the milestones not reached
+    uint64_t accepted, popped, connected, first_up, first_down, closed;
+    uint64_t bytes_up, bytes_down;
+    int32_t err;                // errno of the abort, if known
+    uint16_t reason;            // 0 if closed, 1 + enum metrics_abort_e
+    uint16_t worker;
+    // The last backend the tunnel failed over from, if any
+    struct sockaddr_in6 failed;
+    int32_t failed_err;
+    uint32_t failovers;
+};
+
+struct access_ring_s;
+
+// Set where the records are written, before the workers are started:
+// NULL follows LOG() (stderr, or syslog once daemonized), "syslog", or
+// the path of a file opened in append mode. Returns 0 on error.
+int access_init (const char *dest);
+
+// Flush the records left and stop the writer of the current process
+void access_fini (void);
+
+// A ring of <size> records (rounded up to a power of 2), for the calling
+// event loop. The writer is started at the first ring of the process.
+struct access_ring_s *access_open (unsigned int size);
+
+// The ring is freed by the writer once drained
+void access_close (struct access_ring_s *r);
+
+// Returns 0 if the ring is full and the record dropped
+int access_push (struct access_ring_s *r, const struct access_s *a);
+
+#endif
@@ -0,0 +1,524 @@
+#include <fcntl.h>
+#include <dirent.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+
+#include "./utils.h"
+#include "./metrics.h"
+
+// Load generator for the echo pipelines (proxy-tcp-splice in front of
+// echo-tcp-splice), with one scenario per run and a single JSON line of
+// results on the standard output:
+//   churn: <conns> loops of connect, exchange <size> bytes, close
+//   bulk:  <conns> connections echoing as much as they can
+//   rr:    <size> bytes requests at a fixed open-loop <rate> per second,
+//          spread over <conns> connections. The latency is measured
+//          from the time a request was due, not from the time it was
+//          sent, so that a stall is not hidden by the requests it
+//          delayed (no coordinated omission).
+//   idle:  <conns> connections held open for <duration>
+// With -o pid=PID, the CPU and the memory used by the proxy (PID and its
+// children) are sampled before and after the run, and so are its calls
+// to epoll_ctl() when its metrics are exported for TARGET.
+
+#define CHUNK       65536
+#define BULK_WINDOW 1048576     // echoed bytes in flight per connection
+#define RR_QUEUE    256         // requests due per connection
+
+enum scenario_e
+{ CHURN = 0, BULK, RR, IDLE };
+
+static const char *scenarios[] = { "churn", "bulk", "rr", "idle", NULL };
+
+struct conn_s
+{
+    int fd;
+    int connected;
+    uint32_t events;            // as registered
+    uint64_t started;           // churn: connect() called
+    uint64_t sent, rcvd;        // churn, rr: of the current exchange
+    // rr: due times of the requests not answered yet, the first one
+    // being sent when <sent> is not 0.
+    uint64_t queue[RR_QUEUE];
+    unsigned int qhead, qtail;
+};
+
+static int opt_conns = 64;
+static int opt_duration = 5000;
+static int opt_size = 0;
+static int opt_rate = 10000;
+static int opt_pid = 0;
+
+static struct option_s
+{
+    const char *name;
+    int *value;
+} options[] = {
+    {"conns", &opt_conns},
+    {"duration", &opt_duration},
+    {"size", &opt_size},
+    {"rate", &opt_rate},
+    {"pid", &opt_pid},
+    {NULL, NULL}
+};
+
+static enum scenario_e scenario = CHURN;
+static struct sockaddr_in6 target;
+static int fd_epoll = -1;
+static int stopping = 0;
+static struct conn_s *conns = NULL;
+static struct metrics_shm_s *proxy_metrics = NULL;
+static struct hist_s hist;
+static char payload[CHUNK], sink[CHUNK];
+
+static struct
+{
+    uint64_t connections;       // churn: completed, idle: established
+    uint64_t requests;          // rr: answered
+    uint64_t bytes;             // echoed back
+    uint64_t errors;
+    uint64_t dropped;           // rr: due but the queue was full
+} res;
+
+/* -------------------------------------------------------------------------- */
+
+// CPU time (in clock ticks) and resident memory (in KiB) of <pid> and
+// of its direct children, i.e. the forked workers.
+static void
+proc_sample (int pid, uint64_t * cpu, uint64_t * rss)
+{
+    long page = sysconf (_SC_PAGESIZE) / 1024;
+    struct dirent *de;
+    DIR *d;
+
+    *cpu = *rss = 0;
+    if (pid <= 0 || !(d = opendir ("/proc")))
+        return;
+    while (NULL != (de = readdir (d))) {
+        char path[64], buf[1024], *p;
+        unsigned long long utime, stime;
+        long rsspages;
+        int ppid, fd, me = atoi (de->d_name);
+        ssize_t len;
+
+        if (me <= 0)
+            continue;
+        snprintf (path, sizeof (path), "/proc/%d/stat", me);
+        if (0 > (fd = open (path, O_RDONLY | O_CLOEXEC)))
+            continue;
+        len = read (fd, buf, sizeof (buf) - 1);
+        close (fd);
+        if (len <= 0)
+            continue;
+        buf[len] = '\0';
+        // The command may hold spaces and parentheses
+        if (!(p = strrchr (buf, ')')))
+            continue;
+        if (4 != sscanf (p + 2, "%*c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u "
+                "%llu %llu %*d %*d %*d %*d %*d %*d %*u %*u %ld",
+                &ppid, &utime, &stime, &rsspages))
+            continue;
+        if (me != pid && ppid != pid)
+            continue;
+        *cpu += utime + stime;
+        *rss += rsspages * page;
+    }
+    closedir (d);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+conn_watch (struct conn_s *c, uint32_t events)
+{
+    struct epoll_event evt;
+
+    if (c->events == events)
+        return;
+    evt.data.ptr = c;
+    evt.events = events;
+    if (0 > epoll_ctl (fd_epoll, EPOLL_CTL_MOD, c->fd, &evt))
+        abort ();
+    c->events = events;
+}
+
+static void
+conn_open (struct conn_s *c)
+{
+    struct epoll_event evt;
+    int opt = 1;
+
+    c->connected = 0;
+    c->sent = c->rcvd = 0;
+    c->started = main_now_us ();
+    c->fd = socket (SAFAM (&target), SOCK_STREAM | SOCK_NONBLOCK
+        | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        LOG ("socket() failed : (%d) %s", errno, strerror (errno));
+        exit (1);
+    }
+    setsockopt (c->fd, SOL_TCP, TCP_NODELAY, &opt, sizeof (opt));
+    if (0 > connect (c->fd, SA (&target), SALEN (&target))
+        && errno != EINPROGRESS) {
+        ++res.errors;
+        close (c->fd);
+        c->fd = -1;
+        return;
+    }
+    evt.data.ptr = c;
+    evt.events = c->events = EPOLLOUT;
+    if (0 > epoll_ctl (fd_epoll, EPOLL_CTL_ADD, c->fd, &evt))
+        abort ();
+}
+
+static void
+conn_close (struct conn_s *c)
+{
+    if (c->fd >= 0)
+        close (c->fd);
+    c->fd = -1;
+    c->events = 0;
+}
+
+// Close the connection after an error, and replace it while running
+static void
+conn_fail (struct conn_s *c)
+{
+    ++res.errors;
+    conn_close (c);
+    if (!stopping && scenario != IDLE)
+        conn_open (c);
+}
+
+static int
+conn_send (struct conn_s *c, size_t len)
+{
+    ssize_t rc = send (c->fd, payload, len < CHUNK ? len : CHUNK,
+        MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (rc < 0 && errno != EAGAIN)
+        return -1;
+    if (rc > 0)
+        c->sent += rc;
+    return 0;
+}
+
+// Returns the bytes read, 0 if none yet, -1 on error or at the EOF
+static ssize_t
+conn_recv (struct conn_s *c)
+{
+    ssize_t rc = recv (c->fd, sink, sizeof (sink), MSG_DONTWAIT);
+
+    if (rc < 0)
+        return (errno == EAGAIN) ? 0 : -1;
+    if (rc == 0)
+        return -1;
+    c->rcvd += rc;
+    res.bytes += rc;
+    return rc;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+churn_event (struct conn_s *c, uint32_t events)
+{
+    if (c->sent < (uint64_t) opt_size && conn_send (c, opt_size - c->sent))
+        return conn_fail (c);
+    if ((events & EPOLLIN) && 0 > conn_recv (c))
+        return conn_fail (c);
+    if (c->rcvd >= (uint64_t) opt_size) {
+        hist_record (&hist, main_now_us () - c->started);
+        ++res.connections;
+        conn_close (c);
+        if (!stopping)
+            conn_open (c);
+        return;
+    }
+    conn_watch (c, (c->sent < (uint64_t) opt_size) ? EPOLLOUT : EPOLLIN);
+}
+
+static void
+bulk_event (struct conn_s *c, uint32_t events)
+{
+    if ((events & EPOLLIN) && 0 > conn_recv (c))
+        return conn_fail (c);
+    if (!stopping && c->sent - c->rcvd < BULK_WINDOW
+        && conn_send (c, BULK_WINDOW - (c->sent - c->rcvd)))
+        return conn_fail (c);
+    conn_watch (c, (!stopping && c->sent - c->rcvd < BULK_WINDOW)
+        ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+static void
+rr_send_next (struct conn_s *c)
+{
+    if (c->connected && !c->sent && c->qhead != c->qtail)
+        if (0 > conn_send (c, opt_size))
+            conn_fail (c);
+}
+
+static void
+rr_event (struct conn_s *c, uint32_t events)
+{
+    if (c->sent && c->sent < (uint64_t) opt_size
+        && conn_send (c, opt_size - c->sent))
+        return conn_fail (c);
+    if ((events & EPOLLIN) && 0 > conn_recv (c))
+        return conn_fail (c);
+    while (c->sent >= (uint64_t) opt_size && c->rcvd >= (uint64_t) opt_size) {
+        hist_record (&hist, main_now_us () - c->queue[c->qhead % RR_QUEUE]);
+        ++c->qhead;
+        ++res.requests;
+        c->rcvd -= opt_size;
+        c->sent = 0;
+        rr_send_next (c);
+    }
+    if (c->fd >= 0)
+        conn_watch (c, (c->sent && c->sent < (uint64_t) opt_size)
+            ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+// Give the requests due to the connections, in turn, and return when
+// the next one is due.
+static uint64_t
+rr_schedule (uint64_t start, uint64_t now, uint64_t * due)
+{
+    static unsigned int next = 0;
+
+    for (;; ++*due) {
+        struct conn_s *c = conns + (next % opt_conns);
+        uint64_t when = start + (*due * 1000000) / opt_rate;
+
+        if (when > now)
+            return when;
+        ++next;
+        if (c->qtail - c->qhead >= RR_QUEUE || c->fd < 0) {
+            ++res.dropped;
+            continue;
+        }
+        c->queue[(c->qtail++) % RR_QUEUE] = when;
+        rr_send_next (c);
+    }
+}
+
+static void
+idle_event (struct conn_s *c, uint32_t events)
+{
+    if (!c->sent && conn_send (c, 1))
+        return conn_fail (c);
+    if ((events & EPOLLIN) && 0 > conn_recv (c))
+        return conn_fail (c);
+    if (c->rcvd >= 1 && c->events) {
+        ++res.connections;
+        conn_watch (c, EPOLLRDHUP);
+        return;
+    }
+    conn_watch (c, c->sent ? EPOLLIN : EPOLLOUT);
+}
+
+static void
+manage_event (struct conn_s *c, uint32_t events)
+{
+    if (c->fd < 0)
+        return;
+    if (!c->connected) {
+        if (events & (EPOLLERR | EPOLLHUP))
+            return conn_fail (c);
+        c->connected = 1;
+        if (scenario == RR) {
+            rr_send_next (c);
+            return rr_event (c, 0);
+        }
+    }
+    if (events & (EPOLLERR | EPOLLRDHUP))
+        return conn_fail (c);
+    switch (scenario) {
+        case CHURN:
+            return churn_event (c, events);
+        case BULK:
+            return bulk_event (c, events);
+        case RR:
+            return rr_event (c, events);
+        case IDLE:
+            return idle_event (c, events);
+    }
+}
+
+// Calls to epoll_ctl() by all the event loops of the proxy
+static uint64_t
+metrics_sample (void)
+{
+    uint64_t ctls = 0;
+
+    if (proxy_metrics) {
+        for (uint32_t i = 0; i < proxy_metrics->workers; ++i)
+            ctls += proxy_metrics->block[i].epoll_ctls;
+    }
+    return ctls;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+run (void)
+{
+    struct epoll_event evt[MAXEVT];
+    uint64_t start, now, end, due = 0, cpu0, cpu1, rss0, rss1;
+    uint64_t established = 0, ctls0, ctls1;
+
+    proc_sample (opt_pid, &cpu0, &rss0);
+    ctls0 = metrics_sample ();
+    fd_epoll = epoll_create (1024);
+    conns = calloc (opt_conns, sizeof (struct conn_s));
+    if (fd_epoll < 0 || !conns)
+        abort ();
+    start = main_now_us ();
+    for (int i = 0; i < opt_conns; ++i)
+        conn_open (conns + i);
+
+    // The idle connections are held once established, or after a delay
+    end = start + (uint64_t) opt_duration *1000;
+    while (running) {
+        now = main_now_us ();
+        if (scenario == IDLE && !established
+            && (res.connections >= (uint64_t) opt_conns || now >= end)) {
+            established = now;
+            end = now + (uint64_t) opt_duration *1000;
+        }
+        if (now >= end) {
+            if (scenario != IDLE || established)
+                break;
+        }
+        // Sleep until the next request is due, the sub-millisecond
+        // delays are spun so that they do not count as latency.
+        uint64_t next = end;
+
+        if (scenario == RR)
+            next = rr_schedule (start, now, &due);
+
+        int to = (next < end ? next - now : end - now + 999) / 1000;
+        int rc = epoll_wait (fd_epoll, evt, MAXEVT, to);
+
+        if (rc < 0 && errno != EINTR)
+            abort ();
+        for (int i = 0; i < rc; ++i)
+            manage_event (evt[i].data.ptr, evt[i].events);
+    }
+    now = main_now_us ();
+    proc_sample (opt_pid, &cpu1, &rss1);
+    ctls1 = metrics_sample ();
+    stopping = 1;
+    for (int i = 0; i < opt_conns; ++i)
+        conn_close (conns + i);
+
+    double secs = (double) (now - (scenario == IDLE ? established : start))
+        / 1000000.0;
+    double cpu_ms = (double) (cpu1 - cpu0) * 1000.0 / sysconf (_SC_CLK_TCK);
+    uint64_t units = (scenario == RR) ? res.requests : res.connections;
+
+    printf ("{\"scenario\":\"%s\",\"conns\":%d,\"size\":%d,\"seconds\":%.3f,"
+        "\"connections\":%llu,\"requests\":%llu,\"errors\":%llu,"
+        "\"dropped\":%llu,\"bytes\":%llu,\"mbps\":%.1f,",
+        scenarios[scenario], opt_conns, opt_size, secs,
+        (unsigned long long) res.connections,
+        (unsigned long long) res.requests, (unsigned long long) res.errors,
+        (unsigned long long) res.dropped, (unsigned long long) res.bytes,
+        (double) res.bytes * 8 / 1000000.0 / secs);
+    if (scenario == RR)
+        printf ("\"rate\":%d,\"rps\":%.1f,", opt_rate, res.requests / secs);
+    if (scenario == CHURN)
+        printf ("\"cps\":%.1f,", res.connections / secs);
+    printf ("\"latency_us\":{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,"
+        "\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+        (unsigned long long) hist.count,
+        (unsigned long long) hist_percentile (&hist, 50),
+        (unsigned long long) hist_percentile (&hist, 90),
+        (unsigned long long) hist_percentile (&hist, 99),
+        (unsigned long long) hist_percentile (&hist, 99.9),
+        (unsigned long long) hist.max);
+    if (opt_pid > 0) {
+        printf (",\"proxy_cpu_ms\":%.0f,\"proxy_rss_kb\":%llu", cpu_ms,
+            (unsigned long long) rss1);
+        if (units)
+            printf (",\"cpu_us_per_%s\":%.2f",
+                (scenario == RR) ? "request" : "conn", cpu_ms * 1000 / units);
+        if (scenario == IDLE && res.connections)
+            printf (",\"rss_bytes_per_tunnel\":%lld",
+                (long long) (rss1 - rss0) * 1024
+                / (long long) res.connections);
+    }
+    if (proxy_metrics) {
+        // The churn opens a connection per exchange, the others keep theirs
+        uint64_t opened = (scenario == CHURN) ? res.connections
+            : (uint64_t) opt_conns;
+
+        printf (",\"proxy_epoll_ctls\":%llu,\"epoll_ctls_per_conn\":%.2f",
+            (unsigned long long) (ctls1 - ctls0),
+            (double) (ctls1 - ctls0) / (opened ? opened : 1));
+        if (res.bytes)
+            printf (",\"epoll_ctls_per_mb\":%.2f",
+                (double) (ctls1 - ctls0) * 1000000.0 / res.bytes);
+    }
+    printf ("}\n");
+
+    free (conns);
+    close (fd_epoll);
+}
+
+static int
+bench_option (const char *name, const char *value)
+{
+    for (struct option_s * o = options; o->name; ++o) {
+        if (!strcmp (o->name, name)) {
+            *o->value = atoi (value);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    main_option = bench_option;
+    char **opts = main_init (argc, argv);
+
+    if (!opts[0] || !opts[1]) {
+        LOG ("%s [-o NAME=VALUE]... churn|bulk|rr|idle TARGET", argv[0]);
+        return 1;
+    }
+    for (scenario = 0; scenarios[scenario]; ++scenario) {
+        if (!strcmp (scenarios[scenario], opts[0]))
+            break;
+    }
+    if (!scenarios[scenario]) {
+        LOG ("scenario(%s) unknown", opts[0]);
+        return 1;
+    }
+    if (!sockaddr_init (SA (&target), opts[1])) {
+        LOG ("target(%s) invalid", opts[1]);
+        return 1;
+    }
+    if (opt_conns <= 0 || opt_rate <= 0 || opt_duration <= 0) {
+        LOG ("conns, rate and duration must be positive");
+        return 1;
+    }
+    if (!opt_size)
+        opt_size = (scenario == IDLE) ? 1 : 100;
+
+    if (opt_pid > 0) {
+        char name[128];
+
+        metrics_name (name, sizeof (name), opts[1]);
+        proxy_metrics = metrics_map (name, 0);
+    }
+
+    memset (payload, 'x', sizeof (payload));
+    run ();
+    if (proxy_metrics)
+        metrics_unmap (proxy_metrics);
+    return 0;
+}
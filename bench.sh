@@ -0,0 +1,64 @@
+#!/bin/sh
+
+# Runs the bench-tcp scenarios against proxy-tcp-splice, fed by gen and
+# forwarding to echo-tcp-splice, all on the loopback. Each scenario prints
+# one JSON line on the standard output.
+# The arguments are passed to the proxy, e.g. "bench.sh -f -o engine=uring"
+
+BIN=${BIN:-.}
+DURATION=${DURATION:-5000}
+CONNS=${CONNS:-64}
+RATE=${RATE:-10000}
+IDLE=${IDLE:-1000}
+BACK=127.0.0.1:${BACK_PORT:-18000}
+FRONT=127.0.0.1:${FRONT_PORT:-18080}
+WORK=$(mktemp -d) || exit 1
+FEED=ipc://$WORK/feed
+
+PIDS=
+cleanup () {
+	[ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+	wait 2>/dev/null
+	rm -rf $WORK
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# Each idle connection costs a descriptor to the bench and two to the proxy
+ulimit -n $((IDLE * 3 + 1024)) 2>/dev/null
+
+# Through a FIFO rather than a pipe, to know (and stop) both processes
+mkfifo $WORK/backends || exit 1
+$BIN/refresh-static $BACK > $WORK/backends & PIDS="$PIDS $!"
+$BIN/gen $FEED < $WORK/backends & PIDS="$PIDS $!"
+$BIN/echo-tcp-splice $BACK & PIDS="$PIDS $!"
+sleep 1
+$BIN/proxy-tcp-splice -o access_ring=0 "$@" $FRONT $FEED & PROXY=$!
+PIDS="$PIDS $PROXY"
+sleep 1
+
+run () {
+	$BIN/bench-tcp -o pid=$PROXY -o duration=$DURATION "$@" $FRONT
+}
+
+run -o conns=$CONNS churn
+run -o conns=$CONNS bulk
+run -o conns=$CONNS -o rate=$RATE rr
+run -o conns=$IDLE idle
+
+# The proxy must stop on SIGTERM, with its workers when it forks them
+alive () {
+	for p in "$@"; do kill -0 $p 2>/dev/null && return 0; done
+	return 1
+}
+WORKERS=$(pgrep -P $PROXY 2>/dev/null)
+kill $PROXY
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	alive $PROXY $WORKERS || break
+	sleep 0.5
+done
+if alive $PROXY $WORKERS; then
+	echo "proxy-tcp-splice $* did not stop on SIGTERM" >&2
+	kill -KILL $PROXY $WORKERS 2>/dev/null
+	exit 1
+fi
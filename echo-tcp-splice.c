@@ -6,9 +6,12 @@
 
 #include "./utils.h"
 
-static int fd_epoll = -1;
+static __thread int fd_epoll = -1;
 static int front_backlog = 8192;
 
+static struct sockaddr_storage *servers = NULL;
+static unsigned int count_servers = 0;
+
 struct item_s
 {
     ssize_t loaded;
@@ -71,8 +74,10 @@ manage_client_event (struct item_s *it, uint32_t evt)
     }
     if (evt & EPOLLOUT) {
         if (it->loaded > 0) {
+            // No SPLICE_F_MORE toward the socket, small replies would be
+            // corked and the latencies measured through the echo skewed.
             rc = splice (it->pfd[0], NULL, it->fd, NULL, it->loaded,
-                SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
             if (rc > 0)
                 it->loaded -= rc;
             else if (rc < 0) {
@@ -208,27 +213,26 @@ main_loop ()
 }
 
 static void
-main_init_srv (char **urlv)
+main_init_srv ()
 {
     int rc, opt;
-    struct sockaddr_storage ss;
 
-    for (char **pu = urlv; *pu; ++pu) {
+    for (unsigned int i = 0; i < count_servers; ++i) {
+        struct sockaddr_storage *ss = servers + i;
         struct item_s *srv = malloc (sizeof (struct item_s));
 
         item_init (srv);
 
-        if (!sockaddr_init (SA (&ss), *pu))
-            abort ();
         srv->events = EPOLLIN;
         srv->type = SERVER;
-        srv->fd = socket (SAFAM (&ss), SOCK_STREAM | O_CLOEXEC | O_NONBLOCK, 0);
+        srv->fd = socket (SAFAM (ss), SOCK_STREAM | O_CLOEXEC | O_NONBLOCK, 0);
         ASSERT (srv->fd >= 0);
 
         opt = 1;
         setsockopt (srv->fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof (opt));
+        setsockopt (srv->fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof (opt));
 
-        rc = bind (srv->fd, SA (&ss), SALEN (&ss));
+        rc = bind (srv->fd, SA (ss), SALEN (ss));
         ASSERT (rc == 0);
         rc = listen (srv->fd, front_backlog);
         ASSERT (rc == 0);
@@ -247,15 +251,30 @@ retry_add:
     }
 }
 
+static void
+main_worker ()
+{
+    fd_epoll = epoll_create (1024);
+    ASSERT (fd_epoll >= 0);
+    main_init_srv ();
+    main_loop ();
+    close (fd_epoll);
+}
+
 int
 main (int argc, char **argv)
 {
     char **opts = main_init (argc, argv);
 
-    fd_epoll = epoll_create (1024);
-    ASSERT (fd_epoll >= 0);
-    main_init_srv (opts);
-    main_run (&main_loop);
-    close (fd_epoll);
+    for (char **pu = opts; *pu; ++pu)
+        ++count_servers;
+    servers = calloc (count_servers, sizeof (struct sockaddr_storage));
+    for (unsigned int i = 0; i < count_servers; ++i) {
+        if (!sockaddr_init (SA (servers + i), opts[i]))
+            abort ();
+    }
+
+    main_run (&main_worker);
+    free (servers);
     return 0;
 }
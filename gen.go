@@ -2,19 +2,609 @@ package main
 
 import (
 	"github.com/gdamore/mangos"
+	"github.com/gdamore/mangos/protocol/pull"
 	"github.com/gdamore/mangos/protocol/push"
 	"github.com/gdamore/mangos/transport/ipc"
 	"github.com/gdamore/mangos/transport/tcp"
 	"bufio"
+	"encoding/binary"
+	"errors"
 	"flag"
 	"log"
+	"math"
 	"math/rand"
+	"net"
 	"os"
+	"strconv"
 	"strings"
+	"sync/atomic"
+	"time"
 )
 
 var totrim string = "\r\n\t "
 
+// Binary form of the messages, carrying a batch of tokens. It must be
+// kept in sync with the TOKEN_* macros in utils.h.
+const (
+	tokenMagic   = 0xFB
+	tokenVersion = 1
+	tokenHeader  = 4
+	tokenMaxSize = 4 + 16 + 6
+)
+
+var BadToken error = errors.New("Invalid token, expecting IP:PORT")
+
+// Binary form of the feedback the proxies push back, one message per
+// period and per event loop. It must be kept in sync with the FEEDBACK_*
+// macros in utils.h.
+const (
+	feedbackMagic   = 0xFC
+	feedbackVersion = 1
+	feedbackHeader  = 8
+)
+
+const (
+	// The senders silent for longer are forgotten, with their tunnels
+	feedbackStale = 5 * time.Second
+	// How often the feedback received is folded in the averages
+	feedbackTick = 250 * time.Millisecond
+	// The latency a failed connect weighs, in microseconds
+	failurePenalty = 1e6
+)
+
+var BadFeedback error = errors.New("Invalid feedback message")
+
+// Encode the record for the given "IP:PORT", without the optional
+// identifier and weight.
+func encodeToken(item string) ([]byte, error) {
+	host, sport, err := net.SplitHostPort(item)
+	if err != nil {
+		return nil, err
+	}
+	port, err := strconv.Atoi(sport)
+	if err != nil || port <= 0 || port > 65535 {
+		return nil, BadToken
+	}
+	ip := net.ParseIP(host)
+	if ip == nil {
+		return nil, BadToken
+	}
+	var rec []byte
+	if ip4 := ip.To4(); ip4 != nil {
+		rec = append([]byte{4, 0, 0, 0}, ip4...)
+	} else {
+		rec = append([]byte{6, 0, 0, 0}, ip.To16()...)
+	}
+	binary.BigEndian.PutUint16(rec[2:], uint16(port))
+	return rec, nil
+}
+
+// Decode the records of a feedback message, and return its sender
+func decodeFeedback(msg []byte, record func(addr string, connects, failures, latency, active uint32)) (uint32, error) {
+	if len(msg) < feedbackHeader || msg[0] != feedbackMagic || msg[1] != feedbackVersion {
+		return 0, BadFeedback
+	}
+	count := int(binary.BigEndian.Uint16(msg[2:]))
+	sender := binary.BigEndian.Uint32(msg[4:])
+	b := msg[feedbackHeader:]
+	for ; count > 0; count-- {
+		if len(b) < 4 {
+			return sender, BadFeedback
+		}
+		alen := 4
+		if b[0] == 6 {
+			alen = 16
+		} else if b[0] != 4 {
+			return sender, BadFeedback
+		}
+		if len(b) < 4+alen+16 {
+			return sender, BadFeedback
+		}
+		port := binary.BigEndian.Uint16(b[2:])
+		addr := net.JoinHostPort(net.IP(b[4:4+alen]).String(), strconv.Itoa(int(port)))
+		x := b[4+alen:]
+		record(addr, binary.BigEndian.Uint32(x), binary.BigEndian.Uint32(x[4:]),
+			binary.BigEndian.Uint32(x[8:]), binary.BigEndian.Uint32(x[12:]))
+		b = b[4+alen+16:]
+	}
+	return sender, nil
+}
+
+type backendScore struct {
+	latency float64 // peak EWMA of the connects, in microseconds
+	sum     float64 // latencies of the window, the failures weighed
+	samples float64
+	active  map[uint32]uint32 // established tunnels, per sender
+	seen    map[uint32]time.Time
+}
+
+// Scores aggregates the feedback of the proxies, and periodically
+// publishes the cost of each backend, read without locking by the
+// selection. The latency is a peak EWMA: a slower window is taken at
+// once, a faster one is averaged with a time constant <tau>, and without
+// any connect the latency decays so that an avoided backend is tried
+// again.
+type Scores struct {
+	tau      time.Duration
+	backends map[string]*backendScore
+	costs    atomic.Value // map[string]float64
+}
+
+func NewScores(tau time.Duration) *Scores {
+	s := &Scores{tau: tau, backends: make(map[string]*backendScore)}
+	s.costs.Store(map[string]float64{})
+	return s
+}
+
+func (s *Scores) add(msg []byte, now time.Time) {
+	var sender uint32
+	var err error
+	sender, err = decodeFeedback(msg, func(addr string, connects, failures, latency, active uint32) {
+		b, ok := s.backends[addr]
+		if !ok {
+			b = &backendScore{active: make(map[uint32]uint32), seen: make(map[uint32]time.Time)}
+			s.backends[addr] = b
+		}
+		b.sum += float64(connects)*float64(latency) + float64(failures)*failurePenalty
+		b.samples += float64(connects + failures)
+		b.active[sender] = active
+		b.seen[sender] = now
+	})
+	if err != nil {
+		log.Println("feedback error:", err)
+	}
+}
+
+func (s *Scores) fold(now time.Time) {
+	decay := math.Exp(-float64(feedbackTick) / float64(s.tau))
+	costs := make(map[string]float64, len(s.backends))
+	for addr, b := range s.backends {
+		if b.samples > 0 {
+			sample := b.sum / b.samples
+			if sample > b.latency {
+				b.latency = sample
+			} else {
+				b.latency = b.latency*decay + sample*(1-decay)
+			}
+			b.sum, b.samples = 0, 0
+		} else {
+			b.latency *= decay
+		}
+		outstanding := uint32(0)
+		for sender, seen := range b.seen {
+			if now.Sub(seen) > feedbackStale {
+				delete(b.seen, sender)
+				delete(b.active, sender)
+			} else {
+				outstanding += b.active[sender]
+			}
+		}
+		if len(b.seen) == 0 && b.latency < 1 {
+			delete(s.backends, addr)
+			continue
+		}
+		costs[addr] = (b.latency + 1) * float64(outstanding+1)
+	}
+	s.costs.Store(costs)
+}
+
+// Collect the feedback pushed on <in> until the socket fails
+func (s *Scores) Run(in mangos.Socket) {
+	msgs := make(chan []byte, 64)
+	go func() {
+		for {
+			msg, err := in.Recv()
+			if err != nil {
+				log.Println("feedback error:", err)
+				close(msgs)
+				return
+			}
+			msgs <- msg
+		}
+	}()
+	tick := time.NewTicker(feedbackTick)
+	defer tick.Stop()
+	for {
+		select {
+		case msg, ok := <-msgs:
+			if !ok {
+				s.costs.Store(map[string]float64{})
+				return
+			}
+			s.add(msg, time.Now())
+		case now := <-tick.C:
+			s.fold(now)
+		}
+	}
+}
+
+// A backend, as read from a line "IP:PORT [WEIGHT]" of the input. The
+// weight is 1 by default, a backend that weighs 0 is drained. The address
+// is kept in its canonical form, see canonicalAddr.
+type backend struct {
+	addr   string
+	weight int
+}
+
+// The address in the form the feedback reports it, so that the scores
+// match whatever the form of the line. A host that is not an IP is kept
+// as is.
+func canonicalAddr(addr string) string {
+	host, sport, err := net.SplitHostPort(addr)
+	if err != nil {
+		return addr
+	}
+	ip := net.ParseIP(host)
+	port, err := strconv.Atoi(sport)
+	if ip == nil || err != nil || port <= 0 || port > 65535 {
+		return addr
+	}
+	return net.JoinHostPort(ip.String(), strconv.Itoa(port))
+}
+
+func parseList(lines []string) []backend {
+	tab := make([]backend, 0, len(lines))
+	for _, l := range lines {
+		f := strings.Fields(l)
+		w := 1
+		if len(f) > 1 {
+			var err error
+			if w, err = strconv.Atoi(f[1]); err != nil || w < 0 || len(f) > 2 {
+				log.Println("Invalid item", l)
+				continue
+			}
+		}
+		if w > 0 {
+			tab = append(tab, backend{canonicalAddr(f[0]), w})
+		}
+	}
+	return tab
+}
+
+func sameList(a, b []backend) bool {
+	if len(a) != len(b) {
+		return false
+	}
+	for i := range a {
+		if a[i] != b[i] {
+			return false
+		}
+	}
+	return true
+}
+
+// Whether the lists only differ by their weights
+func sameAddrs(a, b []backend) bool {
+	if len(a) != len(b) {
+		return false
+	}
+	for i := range a {
+		if a[i].addr != b[i].addr {
+			return false
+		}
+	}
+	return true
+}
+
+func equalWeights(tab []backend) bool {
+	for i := range tab {
+		if tab[i].weight != tab[0].weight {
+			return false
+		}
+	}
+	return true
+}
+
+// A policy of selection, called from a single goroutine: Reload with each
+// new list, then Next for each token, that returns the position of the
+// backend in the list, -1 while it is empty.
+type Selector interface {
+	Reload(tab []backend)
+	Next() int
+}
+
+// Smooth weighted round-robin, as a stride scheduler: each backend is due
+// again 1/weight after it has been taken, and the backend due first is
+// taken, so that the heavier backends are interleaved with the others
+// instead of being polled in bursts. O(log n) per token on a heap of the
+// backends, O(1) when they all weigh the same. A new list keeps where the
+// remaining backends stand, the new ones are due half a stride later, in
+// the middle of their first period. When only weights change, the
+// backends concerned are moved in the heap, O(log n) each.
+type roundRobin struct {
+	tab   []backend
+	equal bool
+	i     int
+	heap  []rrEntry // by pass
+	pos   []int32   // of each backend in the heap
+}
+
+// Inlined in the heap, so that sifting does not chase indexes
+type rrEntry struct {
+	pass, stride float64
+	idx          int32
+}
+
+func (r *roundRobin) Reload(tab []backend) {
+	if sameList(tab, r.tab) {
+		return
+	}
+	equal := equalWeights(tab)
+	if !equal && !r.equal && sameAddrs(tab, r.tab) {
+		r.reweight(tab)
+		return
+	}
+	old := make(map[string]float64, len(r.heap))
+	for _, e := range r.heap {
+		old[r.tab[e.idx].addr] = e.pass - r.heap[0].pass
+	}
+	r.tab = tab
+	r.equal = equal
+	r.i = 0
+	r.heap = r.heap[:0]
+	r.pos = r.pos[:0]
+	if r.equal {
+		return
+	}
+	for i := range tab {
+		stride := 1 / float64(tab[i].weight)
+		pass, ok := old[tab[i].addr]
+		if !ok {
+			pass = stride / 2
+		}
+		r.heap = append(r.heap, rrEntry{pass, stride, int32(i)})
+		r.pos = append(r.pos, int32(i))
+	}
+	for i := len(r.heap)/2 - 1; i >= 0; i-- {
+		r.down(i)
+	}
+}
+
+// The backends that changed are due as far from now as they were, at the
+// scale of their new stride.
+func (r *roundRobin) reweight(tab []backend) {
+	for i := range tab {
+		if tab[i].weight == r.tab[i].weight {
+			continue
+		}
+		now, p := r.heap[0].pass, int(r.pos[i])
+		e := &r.heap[p]
+		stride := 1 / float64(tab[i].weight)
+		e.pass = now + (e.pass-now)*stride/e.stride
+		e.stride = stride
+		if !r.up(p) {
+			r.down(p)
+		}
+	}
+	r.tab = tab
+}
+
+func (r *roundRobin) up(i int) bool {
+	h := r.heap
+	e, moved := h[i], false
+	for i > 0 {
+		parent := (i - 1) / 2
+		if h[parent].pass <= e.pass {
+			break
+		}
+		h[i] = h[parent]
+		r.pos[h[i].idx] = int32(i)
+		i, moved = parent, true
+	}
+	h[i] = e
+	r.pos[e.idx] = int32(i)
+	return moved
+}
+
+func (r *roundRobin) down(i int) {
+	h, n := r.heap, len(r.heap)
+	e := h[i]
+	for {
+		m, left := i, 2*i+1
+		if left >= n {
+			break
+		}
+		if left+1 < n && h[left+1].pass < h[left].pass {
+			left++
+		}
+		if h[left].pass >= e.pass {
+			break
+		}
+		h[m] = h[left]
+		r.pos[h[m].idx] = int32(m)
+		i = left
+	}
+	h[i] = e
+	r.pos[e.idx] = int32(i)
+}
+
+func (r *roundRobin) Next() int {
+	if len(r.tab) <= 0 {
+		return -1
+	}
+	if r.equal {
+		r.i = (r.i + 1) % len(r.tab)
+		return r.i
+	}
+	top := r.heap[0].idx
+	r.heap[0].pass += r.heap[0].stride
+	r.down(0)
+	// Keep the passes small, for their precision
+	if base := r.heap[0].pass; base > 1e6 {
+		for i := range r.heap {
+			r.heap[i].pass -= base
+		}
+	}
+	return int(top)
+}
+
+// Weighted random, with the alias method of Vose, in two levels: the
+// backends are split in groups of aliasGroup, each with its own tables,
+// and the group is drawn first, by its total weight. O(1) per token, O(n)
+// to build the tables of a new list, and when only weights change, only
+// the groups concerned and the top level are rebuilt.
+const aliasGroup = 256
+
+type aliasTable struct {
+	tab          []backend
+	prob         []float64 // of each backend, in its group
+	alias        []int32
+	total        []float64 // of each group
+	topProb      []float64
+	topAlias     []int32
+	scaled       []float64
+	small, large []int32
+	rnd          *rand.Rand
+}
+
+func newAliasTable() *aliasTable {
+	return &aliasTable{rnd: rand.New(rand.NewSource(time.Now().UnixNano()))}
+}
+
+func (a *aliasTable) Reload(tab []backend) {
+	if sameList(tab, a.tab) {
+		return
+	}
+	n := len(tab)
+	groups := (n + aliasGroup - 1) / aliasGroup
+	old := a.tab
+	a.tab = tab
+	if sameAddrs(tab, old) {
+		for i := 0; i < n; i++ {
+			if tab[i].weight != old[i].weight {
+				a.group(i / aliasGroup)
+				i = (i/aliasGroup+1)*aliasGroup - 1
+			}
+		}
+	} else {
+		// Each entry is set below, the tables are only grown
+		if cap(a.prob) < n {
+			a.prob = make([]float64, n)
+			a.alias = make([]int32, n)
+		}
+		if cap(a.total) < groups {
+			a.total = make([]float64, groups)
+			a.topProb = make([]float64, groups)
+			a.topAlias = make([]int32, groups)
+		}
+		a.prob, a.alias = a.prob[:n], a.alias[:n]
+		a.total, a.topProb, a.topAlias = a.total[:groups], a.topProb[:groups], a.topAlias[:groups]
+		for g := 0; g < groups; g++ {
+			a.group(g)
+		}
+	}
+	a.vose(groups, func(g int) float64 { return a.total[g] }, a.topProb, a.topAlias, 0)
+}
+
+func (a *aliasTable) group(g int) {
+	lo, hi := g*aliasGroup, (g+1)*aliasGroup
+	if hi > len(a.tab) {
+		hi = len(a.tab)
+	}
+	a.total[g] = a.vose(hi-lo, func(i int) float64 { return float64(a.tab[lo+i].weight) },
+		a.prob[lo:hi], a.alias[lo:hi], int32(lo))
+}
+
+// The tables of the <n> weights, the aliases offset by <base>. Returns
+// the total weight.
+func (a *aliasTable) vose(n int, weight func(int) float64, prob []float64, alias []int32, base int32) float64 {
+	a.scaled = a.scaled[:0]
+	a.small, a.large = a.small[:0], a.large[:0]
+	total := 0.0
+	for i := 0; i < n; i++ {
+		total += weight(i)
+	}
+	for i := 0; i < n; i++ {
+		p := weight(i) * float64(n) / total
+		a.scaled = append(a.scaled, p)
+		if p < 1 {
+			a.small = append(a.small, int32(i))
+		} else {
+			a.large = append(a.large, int32(i))
+		}
+	}
+	for len(a.small) > 0 && len(a.large) > 0 {
+		l := a.small[len(a.small)-1]
+		a.small = a.small[:len(a.small)-1]
+		g := a.large[len(a.large)-1]
+		prob[l] = a.scaled[l]
+		alias[l] = base + g
+		a.scaled[g] += a.scaled[l] - 1
+		if a.scaled[g] < 1 {
+			a.large = a.large[:len(a.large)-1]
+			a.small = append(a.small, g)
+		}
+	}
+	// What remains is 1, but for the rounding errors
+	for _, i := range a.large {
+		prob[i] = 1
+	}
+	for _, i := range a.small {
+		prob[i] = 1
+	}
+	return total
+}
+
+// One draw per level: its integer part is the entry, its fractional part
+// decides between the entry and its alias.
+func (a *aliasTable) pick() int {
+	u := a.rnd.Float64() * float64(len(a.topProb))
+	g := int(u)
+	if u-float64(g) >= a.topProb[g] {
+		g = int(a.topAlias[g])
+	}
+	lo := g * aliasGroup
+	size := len(a.tab) - lo
+	if size > aliasGroup {
+		size = aliasGroup
+	}
+	u = a.rnd.Float64() * float64(size)
+	i := lo + int(u)
+	if u-float64(int(u)) < a.prob[i] {
+		return i
+	}
+	return int(a.alias[i])
+}
+
+func (a *aliasTable) Next() int {
+	if len(a.tab) <= 0 {
+		return -1
+	}
+	return a.pick()
+}
+
+// Power of two choices: the cheaper of two backends drawn at random by
+// their weight, a backend without feedback being tried first. The cost
+// is divided by the weight, a heavier backend bears more load. Without
+// any feedback at all, e.g. before the first reports, the backends are
+// polled in turn.
+type p2c struct {
+	aliasTable
+	rr     roundRobin
+	scores *Scores
+}
+
+func newP2C(s *Scores) *p2c {
+	return &p2c{aliasTable: *newAliasTable(), scores: s}
+}
+
+func (p *p2c) Reload(tab []backend) {
+	p.aliasTable.Reload(tab)
+	p.rr.Reload(tab)
+}
+
+func (p *p2c) Next() int {
+	costs := p.scores.costs.Load().(map[string]float64)
+	if len(costs) == 0 || len(p.tab) <= 1 {
+		return p.rr.Next()
+	}
+	a, b := p.pick(), p.pick()
+	if costs[p.tab[b].addr]/float64(p.tab[b].weight) < costs[p.tab[a].addr]/float64(p.tab[a].weight) {
+		a = b
+	}
+	return a
+}
+
 func input(out chan []string) {
 	reader := bufio.NewReader(os.Stdin)
 	buffer := make([]string, 0)
@@ -22,7 +612,11 @@ func input(out chan []string) {
 		l, err := reader.ReadString('\n')
 		l = strings.TrimRight(strings.TrimLeft(l, totrim), totrim)
 		if err != nil {
-			out <- buffer
+			// The blank line that usually ends the input already sent
+			// the last list, an empty one would replace it
+			if len(buffer) > 0 {
+				out <- buffer
+			}
 			close(out)
 			log.Println("input error:", err)
 			return
@@ -35,43 +629,133 @@ func input(out chan []string) {
 	}
 }
 
-func reload(in chan []string, out chan string, poll func(tab []string) string) {
-	var next string
-	var tab []string
-	for {
-		if next == "" {
-			tab = <-in
-			next = poll(tab)
-		} else {
-			select {
-			case tab = <-in:
-				log.Println("Array reloaded with", len(tab), "items")
-			case out <- next:
-				next = ""
-				next = poll(tab)
+// The generator selects the backends and packs them straight into the
+// message it sends, a whole batch at a time, so that a token costs a
+// selection and a copy of its record, encoded once per list. The legacy
+// text form still carries a single address per message.
+type generator struct {
+	sel   Selector
+	batch int
+	tab   []backend
+	recs  [][]byte // the tokens of <tab>, in the binary form
+	msg   []byte
+}
+
+func newGenerator(sel Selector, batch int) *generator {
+	if batch > 65535 {
+		batch = 65535
+	}
+	g := &generator{sel: sel, batch: batch}
+	if batch > 0 {
+		g.msg = make([]byte, 0, tokenHeader+batch*tokenMaxSize)
+	}
+	return g
+}
+
+func (g *generator) reload(lines []string) {
+	tab := parseList(lines)
+	if g.batch > 0 {
+		recs := make([][]byte, 0, len(tab))
+		valid := tab[:0]
+		for _, b := range tab {
+			rec, err := encodeToken(b.addr)
+			if err != nil {
+				log.Println("Invalid item", b.addr, ":", err)
+				continue
 			}
+			recs = append(recs, rec)
+			valid = append(valid, b)
 		}
+		tab, g.recs = valid, recs
 	}
+	g.tab = tab
+	g.sel.Reload(tab)
 }
 
-func output(in chan string, out mangos.Socket) {
-	if out == nil { panic("Invalid socket"); }
-	for item := range in {
-		out.Send([]byte(item))
+// The next message, nil while the list is empty. It is only valid until
+// the next call, the socket copies it.
+func (g *generator) fill() []byte {
+	if len(g.tab) <= 0 {
+		return nil
 	}
+	if g.batch <= 0 {
+		g.msg = append(g.msg[:0], g.tab[g.sel.Next()].addr...)
+		return g.msg
+	}
+	msg := g.msg[:tokenHeader]
+	for count := 0; count < g.batch; count++ {
+		msg = append(msg, g.recs[g.sel.Next()]...)
+	}
+	msg[0] = tokenMagic
+	msg[1] = tokenVersion
+	binary.BigEndian.PutUint16(msg[2:], uint16(g.batch))
+	g.msg = msg
+	return msg
 }
 
-func Gen(out mangos.Socket, poll func([]string) string) {
+// The messages are sent as fast as the socket takes them, its queue
+// being the only buffer, see queueLen. A new list is looked at before
+// each message is filled, so that none is filled from a stale list.
+func Gen(out mangos.Socket, batch int, sel Selector) {
 	if out == nil { panic("Invalid socket"); }
-	p0 := make(chan []string)
-	p1 := make(chan string)
-	go input(p0)
-	go reload(p0, p1, poll)
-	output(p1, out)
+	lists := make(chan []string)
+	go input(lists)
+	g := newGenerator(sel, batch)
+	for {
+		select {
+		case lines, ok := <-lists:
+			if !ok {
+				// The last list is kept
+				lists = nil
+				break
+			}
+			g.reload(lines)
+			log.Println("Array reloaded with", len(lines), "items")
+		default:
+		}
+		msg := g.fill()
+		if msg == nil {
+			if lists == nil {
+				return
+			}
+			lines, ok := <-lists
+			if !ok {
+				return
+			}
+			g.reload(lines)
+			continue
+		}
+		out.Send(msg)
+	}
 }
 
+// The tokens queued toward the consumers are still drawn from the list
+// they were filled with, so the default queue holds about as many tokens
+// in the binary form as in the text form, whatever the batches.
+const queuedTokens = 128
+
+func queueLen(qlen, batch int) int {
+	if qlen > 0 {
+		return qlen
+	}
+	if batch <= 1 {
+		return queuedTokens
+	}
+	if qlen = queuedTokens / batch; qlen < 2 {
+		qlen = 2
+	}
+	return qlen
+}
+
+// Bind the endpoints given as arguments, and push them the tokens of the
+// lists read on the standard input, selected by the chosen policy.
 func main() {
 	how_rand := flag.Bool("rand", false, "")
+	how_p2c := flag.Bool("p2c", false, "Power of two choices over the feedback of the proxies")
+	feedback := flag.String("feedback", "", "Endpoint to bind to, for the feedback of the proxies")
+	tau := flag.Duration("tau", 2*time.Second, "Time constant of the averages of the feedback")
+	batch := flag.Int("batch", 0, "Tokens per message, in the binary form (0 for the legacy text form)")
+	qlen := flag.Int("qlen", 0, "Messages queued for the consumers (0 for 128 tokens worth)")
 	flag.Parse()
 	if flag.NArg() < 1 {
 		log.Fatal("Missing arguments: at least one endpoint to bind to")
@@ -85,7 +769,7 @@ func main() {
 		defer out.Close()
 		out.AddTransport(ipc.NewTransport())
 		out.AddTransport(tcp.NewTransport())
-		out.SetOption(mangos.OptionWriteQLen, 16)
+		out.SetOption(mangos.OptionWriteQLen, queueLen(*qlen, *batch))
 		out.SetOption(mangos.OptionRetryTime, 0)
 		for i:=0; i<flag.NArg() ;i++ {
 			if err := out.Listen(flag.Arg(i)); err != nil {
@@ -94,22 +778,27 @@ func main() {
 		}
 	}
 
+	scores := NewScores(*tau)
+	if *feedback != "" {
+		var in mangos.Socket
+		if in, err = pull.NewSocket(); err != nil {
+			log.Fatal("Nanomsg socket creation failure: ", err)
+		}
+		defer in.Close()
+		in.AddTransport(ipc.NewTransport())
+		in.AddTransport(tcp.NewTransport())
+		if err := in.Listen(*feedback); err != nil {
+			log.Fatal("Nanomsg listen() error: ", err)
+		}
+		go scores.Run(in)
+	}
+
 	switch {
+		case *how_p2c:
+			Gen(out, *batch, newP2C(scores))
 		case *how_rand:
-			Gen(out, func(tab []string) string {
-				if len(tab) <= 0 {
-					return ""
-				}
-				return tab[rand.Intn(len(tab))]
-			})
+			Gen(out, *batch, newAliasTable())
 		default:
-			i := 0
-			Gen(out, func(tab []string) string {
-				if len(tab) <= 0 {
-					return ""
-				}
-				i = (i + 1) % len(tab)
-				return tab[i]
-			})
+			Gen(out, *batch, &roundRobin{})
 	}
 }
@@ -0,0 +1,144 @@
+package main
+
+import (
+	"fmt"
+	"math"
+	"math/rand"
+	"testing"
+	"time"
+)
+
+// Generate <messages> batches and count the tokens of each backend, by
+// their record.
+func countTokens(t *testing.T, g *generator, messages int) []int {
+	index := make(map[string]int, len(g.recs))
+	for i, rec := range g.recs {
+		index[string(rec)] = i
+	}
+	counts := make([]int, len(g.tab))
+	for m := 0; m < messages; m++ {
+		msg := g.fill()
+		if msg[0] != tokenMagic || int(msg[2])<<8|int(msg[3]) != g.batch {
+			t.Fatalf("bad header %x", msg[:tokenHeader])
+		}
+		for b := msg[tokenHeader:]; len(b) > 0; b = b[8:] {
+			i, ok := index[string(b[:8])]
+			if !ok {
+				t.Fatalf("unknown record %x", b[:8])
+			}
+			counts[i]++
+		}
+	}
+	return counts
+}
+
+// Over whole periods, the smooth round-robin gives each backend exactly
+// its weight, whatever the size of the batches.
+func TestRoundRobinPeriod(t *testing.T) {
+	lines := []string{"10.0.0.1:80 1", "10.0.0.2:80 2", "10.0.0.3:80 3", "10.0.0.4:80 4"}
+	for _, batch := range []int{1, 7, 10} {
+		g := newGenerator(&roundRobin{}, batch)
+		g.reload(lines)
+		counts := countTokens(t, g, 10)
+		for i, c := range counts {
+			if c != batch*g.tab[i].weight {
+				t.Errorf("batch=%d %s: %d tokens, expected %d", batch, g.tab[i].addr, c, batch*g.tab[i].weight)
+			}
+		}
+	}
+}
+
+// The frequencies drawn from the alias tables follow the weights, over
+// more backends than a group so that both levels are exercised.
+func TestAliasFrequencies(t *testing.T) {
+	const batch, messages = 1000, 1000
+	lines := make([]string, 3*aliasGroup/2)
+	total := 0
+	for i := range lines {
+		lines[i] = fmt.Sprintf("10.0.%d.%d:80 %d", i>>8, i&255, 1+i%4)
+		total += 1 + i%4
+	}
+	a := newAliasTable()
+	a.rnd = rand.New(rand.NewSource(1))
+	g := newGenerator(a, batch)
+	g.reload(lines)
+	for i, c := range countTokens(t, g, messages) {
+		expected := float64(batch*messages*g.tab[i].weight) / float64(total)
+		if math.Abs(float64(c)-expected) > 5*math.Sqrt(expected) {
+			t.Errorf("%s: %d tokens, expected %.0f", g.tab[i].addr, c, expected)
+		}
+	}
+}
+
+// The lines are keyed like the feedback reports the backends
+func TestCanonicalAddr(t *testing.T) {
+	for _, c := range []struct{ in, out string }{
+		{"10.0.0.1:80", "10.0.0.1:80"},
+		{"[::ffff:10.0.0.1]:80", "10.0.0.1:80"},
+		{"[2001:DB8:0::01]:443", "[2001:db8::1]:443"},
+		{"10.0.0.1:0080", "10.0.0.1:80"},
+		{"backend.local:80", "backend.local:80"},
+	} {
+		if got := canonicalAddr(c.in); got != c.out {
+			t.Errorf("canonicalAddr(%q) = %q, expected %q", c.in, got, c.out)
+		}
+	}
+}
+
+// The default queue holds about the same count of tokens in both forms
+func TestQueueLen(t *testing.T) {
+	for _, c := range []struct{ qlen, batch, out int }{
+		{0, 0, 128}, {0, 1, 128}, {0, 16, 8}, {0, 64, 2}, {0, 1024, 2}, {16, 1024, 16},
+	} {
+		if got := queueLen(c.qlen, c.batch); got != c.out {
+			t.Errorf("queueLen(%d, %d) = %d, expected %d", c.qlen, c.batch, got, c.out)
+		}
+	}
+}
+
+// The selection and the encoding of the tokens alone, without any socket,
+// on many backends of random weights, e.g.
+//
+//	go test -run NONE -bench Fill gen.go gen_test.go
+func BenchmarkFill(b *testing.B) {
+	const count = 100000
+	lines := make([]string, count)
+	for i := range lines {
+		lines[i] = fmt.Sprintf("10.%d.%d.%d:%d %d", (i>>16)&255, (i>>8)&255, i&255, 1024+i%1000, 1+rand.Intn(10))
+	}
+	selectors := []struct {
+		name string
+		sel  func() Selector
+	}{
+		{"rr", func() Selector { return &roundRobin{} }},
+		{"rand", func() Selector { return newAliasTable() }},
+		{"p2c", func() Selector {
+			// As if each backend had been reported on
+			s := NewScores(time.Second)
+			costs := make(map[string]float64, count)
+			for _, be := range parseList(lines) {
+				costs[be.addr] = 1 + rand.Float64()
+			}
+			s.costs.Store(costs)
+			return newP2C(s)
+		}},
+	}
+	for _, s := range selectors {
+		for _, batch := range []int{0, 64, 1024} {
+			b.Run(fmt.Sprintf("%s/batch=%d", s.name, batch), func(b *testing.B) {
+				g := newGenerator(s.sel(), batch)
+				g.reload(lines)
+				per := batch
+				if per <= 0 {
+					per = 1
+				}
+				b.ReportAllocs()
+				b.ResetTimer()
+				for i := 0; i < b.N; i++ {
+					g.fill()
+				}
+				b.ReportMetric(float64(b.N*per)/b.Elapsed().Seconds(), "tokens/s")
+			})
+		}
+	}
+}
@@ -0,0 +1,136 @@
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "./utils.h"
+#include "./metrics.h"
+
+const char *metrics_abort_names[ABORT_COUNT] = {
+    "peer", "connect", "starvation", "idle", "lifetime"
+};
+
+const char *metrics_hist_names[HIST_COUNT] = {
+    "queue", "connect", "establish", "first_up", "first_down", "lifetime"
+};
+
+uint64_t
+hist_bucket_max (unsigned int idx)
+{
+    if (idx < HIST_SUB)
+        return idx;
+
+    unsigned int shift = idx / HIST_SUB - 1;
+    uint64_t sub = idx % HIST_SUB + HIST_SUB;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void
+hist_merge (struct hist_s *dst, const struct hist_s *src)
+{
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    for (unsigned int i = 0; i < HIST_BUCKETS; ++i)
+        dst->buckets[i] += src->buckets[i];
+}
+
+uint64_t
+hist_percentile (const struct hist_s *h, double pct)
+{
+    uint64_t total = 0, rank, seen = 0;
+
+    // The buckets are summed again, <count> may be ahead of them
+    for (unsigned int i = 0; i < HIST_BUCKETS; ++i)
+        total += h->buckets[i];
+    if (!total)
+        return 0;
+    rank = (uint64_t) (total * pct / 100.0 + 0.5);
+    if (rank < 1)
+        rank = 1;
+    for (unsigned int i = 0; i < HIST_BUCKETS; ++i) {
+        if ((seen += h->buckets[i]) >= rank) {
+            uint64_t v = hist_bucket_max (i);
+
+            return (v < h->max) ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+void
+metrics_name (char *dst, size_t dlen, const char *front)
+{
+    snprintf (dst, dlen, "/lbtk.%s", front);
+    // Only the leading slash is allowed in the name of a segment
+    for (char *p = dst + 1; *p; ++p) {
+        if (*p == '/')
+            *p = '_';
+    }
+}
+
+static size_t
+_shm_size (unsigned int count)
+{
+    return sizeof (struct metrics_shm_s) + count * sizeof (struct metrics_s);
+}
+
+struct metrics_shm_s *
+metrics_map (const char *name, unsigned int count)
+{
+    struct metrics_shm_s *shm;
+    struct stat st;
+    size_t size;
+    int fd;
+
+    if (count > 0) {
+        fd = shm_open (name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return NULL;
+        size = _shm_size (count);
+        if (0 > ftruncate (fd, size)) {
+            close (fd);
+            return NULL;
+        }
+        shm = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close (fd);
+        if (shm == MAP_FAILED)
+            return NULL;
+        memset (shm, 0, size);
+        shm->version = METRICS_VERSION;
+        shm->workers = count;
+        shm->block_size = sizeof (struct metrics_s);
+        __atomic_store_n (&shm->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+        return shm;
+    }
+
+    if (0 > (fd = shm_open (name, O_RDONLY | O_CLOEXEC, 0)))
+        return NULL;
+    if (0 > fstat (fd, &st) || (size_t) st.st_size < _shm_size (0)) {
+        close (fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    shm = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if (shm == MAP_FAILED)
+        return NULL;
+    if (__atomic_load_n (&shm->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC
+        || shm->version != METRICS_VERSION
+        || shm->block_size != sizeof (struct metrics_s)
+        || _shm_size (shm->workers) > (size_t) st.st_size) {
+        munmap (shm, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    return shm;
+}
+
+void
+metrics_unmap (struct metrics_shm_s *shm)
+{
+    if (shm)
+        munmap (shm, _shm_size (shm->workers));
+}
@@ -0,0 +1,157 @@
+#ifndef LB_METRICS_H
+#define LB_METRICS_H 1
+
+#include <stdint.h>
+
+#include "./slab.h"
+
+// Counters of the event loops, exported in a shared memory segment. Each
+// event loop is the only writer of its own block, aligned on its own
+// cache lines so that the workers never share a line. The readers do not
+// lock anything: the aligned 64-bit words are never read torn, and a dump
+// is only a snapshot of counters that keep moving.
+
+#define METRICS_MAGIC   0x4C42544B      // "LBTK"
+#define METRICS_VERSION 13
+#define METRICS_ALIGN   64
+
+enum metrics_abort_e
+{
+    ABORT_PEER = 0,             // error on a channel, or on its peer
+    ABORT_CONNECT,              // connect() failed, no failover left
+    ABORT_STARVATION,           // no backend in time
+    ABORT_IDLE,
+    ABORT_LIFETIME,
+    ABORT_COUNT
+};
+
+// Log-linear histograms of latencies, in microseconds, in the spirit of
+// HdrHistogram: the values below HIST_SUB are exact, then each power of 2
+// is split in HIST_SUB buckets, so that the relative error stays below
+// 1/HIST_SUB. The values beyond the last bucket (about 19 hours) are
+// clamped to it.
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+enum metrics_hist_e
+{
+    HIST_QUEUE = 0,             // accept -> backend popped from the feed
+    HIST_CONNECT,               // backend popped -> connected, with failovers
+    HIST_ESTABLISH,             // accept -> connected
+    HIST_FIRST_UP,              // accept -> first byte spliced to the backend
+    HIST_FIRST_DOWN,            // connected -> first byte spliced to the client
+    HIST_LIFETIME,              // accept -> close
+    HIST_COUNT
+};
+
+struct hist_s
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline unsigned int
+hist_index (uint64_t v)
+{
+    if (v < HIST_SUB)
+        return v;
+
+    unsigned int shift = 63 - __builtin_clzll (v) - HIST_SUB_BITS;
+    unsigned int idx = (shift + 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+
+    return (idx < HIST_BUCKETS) ? idx : HIST_BUCKETS - 1;
+}
+
+// A few instructions and no allocation, cheap enough to stay enabled
+static inline void
+hist_record (struct hist_s *h, uint64_t v)
+{
+    ++h->count;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+    ++h->buckets[hist_index (v)];
+}
+
+// Upper bound of the values that fall in the bucket <idx>
+uint64_t hist_bucket_max (unsigned int idx);
+
+void hist_merge (struct hist_s *dst, const struct hist_s *src);
+
+// The value under which lie <pct> percents of the samples
+uint64_t hist_percentile (const struct hist_s *h, double pct);
+
+struct metrics_s
+{
+    uint64_t started;           // epoch, in seconds, 0 if never started
+    uint64_t pid;
+
+    // Monotonic counters
+    uint64_t accepts;
+    uint64_t connects;
+    uint64_t failovers;
+    uint64_t fastopens;         // connects with the client's bytes in the SYN
+    uint64_t fastopen_misses;   // whose SYN data the backend did not take
+    uint64_t port_exhaustions;  // connects without a free local port
+    uint64_t warm_hits;         // back sockets taken from the pool
+    uint64_t warm_drops;        // closed in the pool, dead or too old
+    uint64_t starvations;       // clients that had to wait for a backend
+    uint64_t aborts[ABORT_COUNT];
+    uint64_t bytes_up;          // spliced from the clients to the backends
+    uint64_t bytes_down;        // spliced from the backends to the clients
+    uint64_t splice_eagain;
+    uint64_t copies;            // small reads copied rather than spliced
+    uint64_t copy_spills;       // copies the peer did not take at once
+    uint64_t path_switches;     // between copying and splicing
+    uint64_t offloads;          // tunnels handed to the sockmap
+    uint64_t offload_fallbacks; // left to the splice path, see -o sockmap
+    uint64_t wakeups;           // returns from epoll_wait / io_uring_enter
+    uint64_t events;            // events or completions polled
+    uint64_t epoll_ctls;        // calls to epoll_ctl()
+    uint64_t access_drops;      // records lost, their ring being full
+    uint64_t feedback_drops;    // messages the generators did not take
+    uint64_t pipe_resizes;
+    uint64_t lean_admits;       // tunnels admitted with small buffers
+    uint64_t budget_pauses;     // accepts paused by the memory budget
+
+    // Gauges
+    uint64_t tunnels;
+    uint64_t waiting;
+    uint64_t offloaded;         // tunnels in the sockmap
+    uint64_t warm_pooled;       // connections opened ahead, see -o warm
+    uint64_t pipes_used;        // attached to a channel
+    uint64_t pipes_open;        // with their descriptors, idle ones too
+    uint64_t pipe_bytes;        // capacity of the open pipes
+    uint64_t pipe_idle_bytes;   // capacity of the open pipes in the pool
+    struct slab_stats_s slab;   // of the tunnels, pipes and clients
+    uint64_t sockbuf_bytes;     // committed to the buffers of the sockets
+
+    struct hist_s hist[HIST_COUNT];
+} __attribute__ ((aligned (METRICS_ALIGN)));
+
+struct metrics_shm_s
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t workers;           // blocks in use
+    uint32_t block_size;        // sizeof (struct metrics_s)
+    struct metrics_s block[] __attribute__ ((aligned (METRICS_ALIGN)));
+};
+
+extern const char *metrics_abort_names[ABORT_COUNT];
+extern const char *metrics_hist_names[HIST_COUNT];
+
+// Name of the segment of the proxy serving <front>
+void metrics_name (char *dst, size_t dlen, const char *front);
+
+// Create (and reset) the segment for <count> blocks, or map an existing
+// one read-only if <count> is 0. Returns NULL on error, with errno set.
+struct metrics_shm_s *metrics_map (const char *name, unsigned int count);
+
+void metrics_unmap (struct metrics_shm_s *shm);
+
+#endif
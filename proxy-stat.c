@@ -0,0 +1,174 @@
+#include <stddef.h>
+#include <time.h>
+
+#include "./utils.h"
+#include "./metrics.h"
+
+// Dump the counters exported by proxy-tcp-splice, one line per event
+// loop and a line of totals, then the percentiles of the latencies merged
+// from all the event loops, every <-i SECONDS> if set.
+
+#define FIELD(F) { #F, offsetof (struct metrics_s, F) }
+
+static const struct
+{
+    const char *name;
+    size_t offset;
+} fields[] = {
+    FIELD (accepts),
+    FIELD (connects),
+    FIELD (failovers),
+    FIELD (fastopens),
+    FIELD (fastopen_misses),
+    FIELD (port_exhaustions),
+    FIELD (warm_hits),
+    FIELD (warm_drops),
+    FIELD (starvations),
+    FIELD (bytes_up),
+    FIELD (bytes_down),
+    FIELD (splice_eagain),
+    FIELD (copies),
+    FIELD (copy_spills),
+    FIELD (path_switches),
+    FIELD (offloads),
+    FIELD (offload_fallbacks),
+    FIELD (wakeups),
+    FIELD (events),
+    FIELD (epoll_ctls),
+    FIELD (access_drops),
+    FIELD (feedback_drops),
+    FIELD (pipe_resizes),
+    FIELD (lean_admits),
+    FIELD (budget_pauses),
+    FIELD (tunnels),
+    FIELD (waiting),
+    FIELD (offloaded),
+    FIELD (warm_pooled),
+    FIELD (pipes_used),
+    FIELD (pipes_open),
+    FIELD (pipe_bytes),
+    FIELD (pipe_idle_bytes),
+    {"slab_arenas", offsetof (struct metrics_s, slab.arenas)},
+    {"slab_bytes", offsetof (struct metrics_s, slab.bytes)},
+    {"slab_objects", offsetof (struct metrics_s, slab.objects)},
+    {"slab_idle", offsetof (struct metrics_s, slab.idle)},
+    {"slab_unmaps", offsetof (struct metrics_s, slab.unmaps)},
+    {"slab_huge_fallbacks", offsetof (struct metrics_s, slab.huge_fallbacks)},
+    FIELD (sockbuf_bytes),
+    {NULL, 0}
+};
+
+static uint64_t
+_get (const struct metrics_s *m, size_t offset)
+{
+    return *(const uint64_t *) ((const char *) m + offset);
+}
+
+static void
+_dump_line (const char *label, const struct metrics_s *m)
+{
+    printf ("%-6s", label);
+    for (int i = 0; fields[i].name; ++i)
+        printf (" %llu", (unsigned long long) _get (m, fields[i].offset));
+    for (int i = 0; i < ABORT_COUNT; ++i)
+        printf (" %llu", (unsigned long long) m->aborts[i]);
+    printf ("\n");
+}
+
+// The blocks keep moving meanwhile, each one is copied a word at a time
+// before it is printed.
+static void
+_snapshot (struct metrics_s *dst, const struct metrics_s *src)
+{
+    const volatile uint64_t *s = (const volatile uint64_t *) src;
+    uint64_t *d = (uint64_t *) dst;
+
+    for (size_t i = 0; i < sizeof (*dst) / sizeof (uint64_t); ++i)
+        d[i] = s[i];
+}
+
+static void
+_dump_hist (const struct metrics_s *total)
+{
+    static const double pct[] = { 50, 90, 99, 99.9 };
+
+    printf ("latency(us) count mean p50 p90 p99 p99.9 max\n");
+    for (int i = 0; i < HIST_COUNT; ++i) {
+        const struct hist_s *h = total->hist + i;
+
+        printf ("%-11s %llu %llu", metrics_hist_names[i],
+            (unsigned long long) h->count,
+            (unsigned long long) (h->count ? h->sum / h->count : 0));
+        for (unsigned int k = 0; k < sizeof (pct) / sizeof (pct[0]); ++k)
+            printf (" %llu", (unsigned long long) hist_percentile (h, pct[k]));
+        printf (" %llu\n", (unsigned long long) h->max);
+    }
+}
+
+static void
+_dump (const struct metrics_shm_s *shm)
+{
+    // Too large for the stack, with their histograms
+    static struct metrics_s m, total;
+    char label[16];
+
+    memset (&total, 0, sizeof (total));
+    printf ("worker");
+    for (int i = 0; fields[i].name; ++i)
+        printf (" %s", fields[i].name);
+    for (int i = 0; i < ABORT_COUNT; ++i)
+        printf (" abort_%s", metrics_abort_names[i]);
+    printf ("\n");
+
+    for (unsigned int w = 0; w < shm->workers; ++w) {
+        _snapshot (&m, shm->block + w);
+        if (!m.started)
+            continue;
+        snprintf (label, sizeof (label), "%u", w);
+        _dump_line (label, &m);
+        for (int i = 0; fields[i].name; ++i)
+            *(uint64_t *) ((char *) &total + fields[i].offset) +=
+                _get (&m, fields[i].offset);
+        for (int i = 0; i < ABORT_COUNT; ++i)
+            total.aborts[i] += m.aborts[i];
+        for (int i = 0; i < HIST_COUNT; ++i)
+            hist_merge (total.hist + i, m.hist + i);
+    }
+    _dump_line ("total", &total);
+    _dump_hist (&total);
+    fflush (stdout);
+}
+
+int
+main (int argc, char **argv)
+{
+    struct metrics_shm_s *shm;
+    char name[128];
+    int interval = 0, i = 1;
+
+    if (i + 1 < argc && !strcmp (argv[i], "-i")) {
+        interval = atoi (argv[i + 1]);
+        i += 2;
+    }
+    if (i + 1 != argc) {
+        LOG ("%s [-i SECONDS] FRONT", argv[0]);
+        return 1;
+    }
+
+    metrics_name (name, sizeof (name), argv[i]);
+    if (!(shm = metrics_map (name, 0))) {
+        LOG ("metrics(%s) unavailable : (%d) %s", name, errno,
+            strerror (errno));
+        return 1;
+    }
+
+    for (;;) {
+        _dump (shm);
+        if (interval <= 0)
+            break;
+        sleep (interval);
+    }
+
+    metrics_unmap (shm);
+    return 0;
+}
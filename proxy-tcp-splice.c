@@ -1,13 +1,29 @@
 #include <fcntl.h>
+#include <stddef.h>
+#include <time.h>
 
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/tcp.h>
 
 #include <nanomsg/nn.h>
 #include <nanomsg/pipeline.h>
 
 #include "./utils.h"
+#include "./uring.h"
+#include "./wheel.h"
+#include "./slab.h"
+#include "./metrics.h"
+#include "./accesslog.h"
+#include "./sockmap.h"
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT 24
+#endif
 
 #define FLAG_SHUT_SENT    0x0001
 #define FLAG_SHUT_RECV    0x0002
@@ -21,6 +37,8 @@
 #define FLAG_ACTIVITY     (FLAG_ERRONEOUS)
 
 #define FLAG_REGISTERED   0x0040
+#define FLAG_PAUSED       0x0080
+#define FLAG_THROTTLED    0x0100
 
 #define SETONE(F,S,O) (((F)&(~(S)))|(O))
 #define SETLIST(F,L)  SETONE(F,FLAG_LISTED,L)
@@ -39,14 +57,33 @@
 
 #define BOTH (EPOLLIN|EPOLLOUT)
 
+// With the io_uring engine, the type of the operation is kept in the low
+// bits of the user_data, along with the pointer to the monitored item.
+#define UD_NONE    0
+#define UD_POLL    1
+#define UD_CONNECT 2
+#define UD_ACCEPT  3
+#define UD_FEED    4
+#define UD(p,T)    (((uint64_t)(uintptr_t)(p))|(T))
+#define UD_PTR(u)  ((void*)(uintptr_t)((u)&~((uint64_t)7)))
+#define UD_TAG(u)  ((u)&7)
+
+// With ENGINE_EDGE, the sockets of the tunnels are registered once in
+// epoll, edge-triggered for both directions, and their readiness is
+// tracked here instead of rearming an EPOLLONESHOT registration.
+enum engine_e
+{ ENGINE_EPOLL = 0, ENGINE_URING, ENGINE_EDGE };
+
 typedef struct monitored_s monitored_t;
+typedef struct feed_s feed_t;
 typedef struct proxy_s proxy_t;
 typedef struct pipe_s pipe_t;
 typedef struct tunnel_s tunnel_t;
 typedef struct channel_s channel_t;
+typedef struct client_s client_t;
 
 enum item_type_e
-{ PROXY = 1, CHANNEL };
+{ PROXY = 1, CHANNEL, FEED, TUNNEL };
 
 #define MONITORED_FIELDS \
     void *next; \
@@ -59,6 +96,28 @@ struct monitored_s
     MONITORED_FIELDS;
 };
 
+// The ring of prefetched backends is refilled in batches when the
+// NN_RCVFD of the nanomsg socket becomes readable.
+struct feed_s
+{
+    MONITORED_FIELDS;
+    int nn;
+    int fd;
+    struct token_ring_s tokens;
+    // The way back to the generators, see -o feedback
+    int fb;
+    uint32_t sender;
+    struct wheel_timer_s timer; // at the end of the period
+};
+
+// A connection to a backend, opened before a client needs it
+struct warm_s
+{
+    int sock;                   // -1 once taken or dropped
+    uint64_t opened;
+    struct sockaddr_in6 to;
+};
+
 struct proxy_s
 {
     MONITORED_FIELDS;
@@ -67,8 +126,24 @@ struct proxy_s
         unsigned int count;
         unsigned int max;
     } pipes;
+    // FIFO of the tunnels accepted while no backend was available
+    struct
+    {
+        tunnel_t *head, *tail;
+        unsigned int count;
+    } waiting;
+    // FIFO of the backend connections opened ahead of the clients, toward
+    // the backends of the tokens still in the feed. See -o warm.
+    struct
+    {
+        struct warm_s *tab;
+        unsigned int head, tail, mask;
+        unsigned int count;     // open, the holes left aside
+        unsigned int ahead;     // next token of the feed to warm up
+        struct wheel_timer_s timer;     // at the age limit of the oldest
+    } warm;
     int sock_front;
-    int nn_feed;
+    feed_t feed;
 };
 
 struct channel_s
@@ -80,75 +155,330 @@ struct channel_s
     channel_t *peer;
     pipe_t *tosend;
     int sock;
+    unsigned int inflight;      // io_uring operations pending
+    uint32_t ready;             // ENGINE_EDGE: readiness not consumed yet
+    struct wheel_timer_s timer; // while THROTTLED
+    // Capacity of the pipes filled from this channel, and how many of
+    // them were drained in a row without having been needed.
+    int pipe_want;
+    unsigned int pipe_calm;
+    // Average of its reads, and whether they are copied or spliced
+    int chunk;
+    int copying;
+    // Once offloaded, its cookie in the sockmap, and the bytes written to
+    // the socket before, by the event loop.
+    uint64_t cookie;
+    uint64_t written;
     const char *which;
 };
 
+// Token bucket, with a capacity of <burst> bytes and refilled at <rate>
+// bytes per second.
+struct bucket_s
+{
+    int64_t tokens;
+    uint64_t stamp;
+};
+
+// The clients are grouped by network prefix (/24 in IPv4, /64 in IPv6),
+// and each group shares a bucket while it has tunnels open.
+struct client_s
+{
+    client_t *next;             // IDLE, hash chain
+    unsigned int refs;
+    unsigned int slot;          // in clients[]
+    uint8_t key[9];             // family, then prefix
+    struct bucket_s bucket;
+};
+
 struct tunnel_s
 {
     uint64_t id;
     proxy_t *proxy;
-    tunnel_t *next;             // IDLE, DIRTY, NULL
+    tunnel_t *next;             // IDLE, DIRTY, WAITING, NULL
+    uint64_t deadline;          // to get a backend, then to connect to it
+    uint64_t started, touched;  // accepted, last activity
+    struct wheel_timer_s timer; // at the nearest deadline
+    unsigned int attempts;      // failovers to another backend
+    struct sockaddr_in6 failed; // the last backend failed over from
+    int failed_err;
+    client_t *client;           // when shaped by client prefix
+    struct bucket_s bucket;
+    // Milestones, in microseconds, 0 until reached
+    struct
+    {
+        uint64_t accepted, popped, connected, first_up, first_down;
+    } stamps;
+    uint64_t bytes_up, bytes_down;
+    uint16_t reason;            // for the access log, see struct access_s
+    int err;
+    int lean;                   // admitted with small buffers
+    uint64_t sockbufs;          // committed to the buffers of its sockets
+    int offloaded;              // forwarded by the kernel, see -o sockmap
+    unsigned int drains;        // polls of a FIN held back, in a row
+    uint64_t relayed;           // by the kernel, at the last poll
+    int syn_data;               // peeked from the client, sent in the SYN
+    int warm;                   // its back socket came from the pool
+    int active;                 // counted by the feedback of its backend
+    uint64_t dialed;            // when its connect started, in microseconds
     channel_t front, back;
+    struct sockaddr_in6 from, to;
 };
 
 struct pipe_s
 {
     pipe_t *next;               // IDLE, NULL
     int load;
+    int peak;                   // highest load since acquired
+    int size;                   // capacity, once open
     int fd[2];
 };
 
+// A pipe grows when a single read fills it from empty, and shrinks after
+// PIPE_CALM uses that did not fill a quarter of it. A pipe still full of
+// data a slow peer did not consume is not a reason to grow.
+#define PIPE_GROWTH 4
+#define PIPE_CALM   16
+
+// The small reads are copied through a buffer of the event loop. It is a
+// page large, the least a pipe can hold, so that what the peer does not
+// accept at once can always be moved to a pipe.
+#define COPY_SIZE   4096
+
+// A FIN received by an offloaded tunnel is only forwarded once the data
+// before it is written, polled from 1ms up to 1<<DRAIN_MAX ms.
+#define DRAIN_MAX   7
+#define DRAINING(c) (ISANY ((c)->flags, FLAG_SHUT_RECV) \
+        && !ISANY ((c)->peer->flags, FLAG_SHUT_SENT))
+
+// All the runtime state below is private to an event loop: when the
+// workers are threads, each of them owns its epoll, its lists and its
+// pools of structures.
+
 // Tunnels are indirectly referenced in epoll_event structures via
 // the channel_t poiters. One tunnel is referenced 2 times, so
 // we cannot clean a tunnel based on a channel's event.
 // The idea is then to play with 2 cache lists : one for really
 // idle structures (not being monitored with epoll) and one for
 // tunnels that vahe been clean during an epoll_ctl round.
-static tunnel_t *IDLE_STRUCT_NAME (tunnel_t) = NULL;
-static tunnel_t *DIRTY_STRUCT_NAME (tunnel_t) = NULL;
+static __thread tunnel_t *IDLE_STRUCT_NAME (tunnel_t) = NULL;
+static __thread tunnel_t *DIRTY_STRUCT_NAME (tunnel_t) = NULL;
+static __thread struct slab_s SLAB_STRUCT_NAME (tunnel_t);
 
 // Pipes do not have this problem, because hey are only pointed
 // once, in the channel_t structures.
-static pipe_t *IDLE_STRUCT_NAME (pipe_t) = NULL;
-
-static channel_t *ACTIVE_STRUCT_NAME (channel_t) = NULL;
-
-static proxy_t *ACTIVE_STRUCT_NAME (proxy_t) = NULL;
-
-static int fd_epoll = -1;
-static int count_epoll = 0;
+static __thread pipe_t *IDLE_STRUCT_NAME (pipe_t) = NULL;
+static __thread struct slab_s SLAB_STRUCT_NAME (pipe_t);
+
+static __thread channel_t *ACTIVE_STRUCT_NAME (channel_t) = NULL;
+
+static __thread proxy_t *ACTIVE_STRUCT_NAME (proxy_t) = NULL;
+
+// Buckets of the clients, by prefix, and the share of the global rate
+// given to this event loop.
+#define CLIENT_SLOTS 4096
+static __thread client_t *IDLE_STRUCT_NAME (client_t) = NULL;
+static __thread struct slab_s SLAB_STRUCT_NAME (client_t);
+static __thread client_t *clients[CLIENT_SLOTS];
+static __thread struct bucket_s global_bucket;
+static __thread char copy_buf[COPY_SIZE];
+static __thread int global_rate = 0;
+
+static __thread int fd_epoll = -1;
+static __thread int count_epoll = 0;
+static __thread struct uring_s ring;
+static __thread struct wheel_s timers;
+static __thread uint64_t now_ms = 0;    // refreshed once per loop
+static __thread uint64_t now_us = 0;    // same, in microseconds
 static int front_backlog = 8192;
 
+static int opt_engine = ENGINE_EPOLL;
+static int opt_tokens = 256;
+static int opt_pending = 1024;
+static int opt_pending_timeout = 1000;
+static int opt_connect_retries = 2;
+static int opt_connect_timeout = 5000;
+static int opt_idle_timeout = 0;
+static int opt_max_lifetime = 0;
+static int opt_rate_tunnel = 0;
+static int opt_rate_client = 0;
+static int opt_rate_global = 0;
+static int opt_rate_burst = 100;
 static int opt_buffer_size = 1;
 static int opt_chatty_update = 1;
 static int opt_chatty_front = 1;
 static int opt_chatty_back = 1;
+static int opt_metrics = 1;
+static int opt_access_ring = 4096;
+static int opt_slab_huge = 0;
+static int opt_slab_lock = 0;
+static int opt_prewarm = 1024;
+static int opt_idle_high = 4096;
+static int opt_idle_low = 1024;
+static int opt_pipe_min = 16384;
+static int opt_pipe_max = PIPE_SIZE;
+static int opt_pipe_pool = 8388608;
+static int opt_pipe_prewarm = 64;
+static int opt_mem_budget = 0;
+static int opt_max_conns = 0;
+static int opt_buffer_lean = 16384;
+static int opt_copy_max = 2048;
+static int opt_sockmap = 0;
+static int opt_defer_accept = 0;
+static int opt_fastopen = 0;
+static int opt_warm = 0;
+static int opt_warm_age = 30000;
+static int opt_feedback_period = 1000;
+static const char *opt_access_log = NULL;
+static const char *opt_sources = NULL;
+static const char *opt_feedback = NULL;
+
+static const char *engines[] = { "epoll", "uring", "edge", NULL };
+
+// The options that can be set with "-o NAME=VALUE". When <choices> is
+// set, the value is the position of the string in that array. The
+// options with a <text> keep the string as is.
+static struct option_s
+{
+    const char *name;
+    int *value;
+    const char **choices;
+    const char **text;
+} options[] = {
+    {"engine", &opt_engine, engines, NULL},
+    {"backlog", &front_backlog, NULL, NULL},
+    {"tokens", &opt_tokens, NULL, NULL},
+    {"pending", &opt_pending, NULL, NULL},
+    {"pending_timeout", &opt_pending_timeout, NULL, NULL},
+    {"connect_retries", &opt_connect_retries, NULL, NULL},
+    {"connect_timeout", &opt_connect_timeout, NULL, NULL},
+    {"idle_timeout", &opt_idle_timeout, NULL, NULL},
+    {"max_lifetime", &opt_max_lifetime, NULL, NULL},
+    {"rate_tunnel", &opt_rate_tunnel, NULL, NULL},
+    {"rate_client", &opt_rate_client, NULL, NULL},
+    {"rate_global", &opt_rate_global, NULL, NULL},
+    {"rate_burst", &opt_rate_burst, NULL, NULL},
+    {"buffer_size", &opt_buffer_size, NULL, NULL},
+    {"chatty_update", &opt_chatty_update, NULL, NULL},
+    {"chatty_front", &opt_chatty_front, NULL, NULL},
+    {"chatty_back", &opt_chatty_back, NULL, NULL},
+    {"metrics", &opt_metrics, NULL, NULL},
+    {"access_ring", &opt_access_ring, NULL, NULL},
+    {"access_log", NULL, NULL, &opt_access_log},
+    {"sources", NULL, NULL, &opt_sources},
+    {"feedback", NULL, NULL, &opt_feedback},
+    {"feedback_period", &opt_feedback_period, NULL, NULL},
+    {"slab_huge", &opt_slab_huge, NULL, NULL},
+    {"slab_lock", &opt_slab_lock, NULL, NULL},
+    {"prewarm", &opt_prewarm, NULL, NULL},
+    {"idle_high", &opt_idle_high, NULL, NULL},
+    {"idle_low", &opt_idle_low, NULL, NULL},
+    {"pipe_min", &opt_pipe_min, NULL, NULL},
+    {"pipe_max", &opt_pipe_max, NULL, NULL},
+    {"pipe_pool", &opt_pipe_pool, NULL, NULL},
+    {"pipe_prewarm", &opt_pipe_prewarm, NULL, NULL},
+    {"mem_budget", &opt_mem_budget, NULL, NULL},
+    {"max_conns", &opt_max_conns, NULL, NULL},
+    {"buffer_lean", &opt_buffer_lean, NULL, NULL},
+    {"copy_max", &opt_copy_max, NULL, NULL},
+    {"sockmap", &opt_sockmap, NULL, NULL},
+    {"defer_accept", &opt_defer_accept, NULL, NULL},
+    {"fastopen", &opt_fastopen, NULL, NULL},
+    {"warm", &opt_warm, NULL, NULL},
+    {"warm_age", &opt_warm_age, NULL, NULL},
+    {NULL, NULL, NULL, NULL}
+};
 
-static uint64_t next_tunnel_id = 0;
+// The rank of the worker is kept in the upper bits, so that the IDs
+// remain unique in the access log.
+static __thread uint64_t next_tunnel_id = 0;
+
+// The block of counters of the event loop, in the shared segment or
+// private when the metrics are not exported.
+static struct metrics_shm_s *metrics_shm = NULL;
+static __thread struct metrics_s metrics_local;
+static __thread struct metrics_s *metrics = NULL;
+
+// Ring of the access records of the event loop, NULL if disabled
+static __thread struct access_ring_s *access_ring = NULL;
+
+// Memory budget of the event loop, in bytes, 0 if unlimited, and the
+// buffers the kernel gives to the sockets left to their autotuning.
+static __thread uint64_t budget = 0;
+static int sockbuf_rcv_default = 131072;
+static int sockbuf_snd_default = 16384;
+
+// The local addresses of the back sockets, see -o sources, and for each
+// slot of backends, the next one to bind.
+#define SOURCE_SLOTS 256
+static struct sockaddr_in6 *sources = NULL;
+static unsigned int sources_count = 0;
+static __thread unsigned int source_next[SOURCE_SLOTS];
+
+// What the event loop observed of each backend since the last feedback,
+// in an open-addressing table, only allocated with -o feedback. The
+// backends with tunnels still established are kept from one period to
+// the next, and reported once more when their last tunnel is gone, the
+// others are forgotten once reported.
+#define BACKEND_SLOTS 4096
+struct backend_s
+{
+    struct sockaddr_in6 to;     // AF_UNSPEC when the slot is free
+    uint32_t connects, failures, active;
+    uint32_t timed;             // connects whose latency is in <latency>
+    uint32_t carried;           // reported with tunnels the last period
+    uint64_t latency;
+};
+static __thread struct backend_s *backends = NULL;
+static __thread struct backend_s *backends_spare = NULL;
+static __thread unsigned int backends_count = 0;
+
+// The sockmap of the event loop, when -o sockmap is set and BPF usable,
+// and the tunnels it holds.
+static __thread struct sockmap_s sockmap;
+static __thread int sockmap_ready = 0;
+static __thread unsigned int sockmap_count = 0;
 
 /* -------------------------------------------------------------------------- */
 
 ACQUIRE_STRUCT_DECL (pipe_t);
+RELEASE_STRUCT_DECL (pipe_t);
 PURGE_STRUCT_DECL (pipe_t);
 
+ACQUIRE_STRUCT_DECL (client_t);
+RELEASE_STRUCT_DECL (client_t);
+PURGE_STRUCT_DECL (client_t);
+
 static void channel_close (channel_t * chan);
 static void channel_shut (channel_t * chan);
 static void channel_transfer (channel_t * src);
 static void channel_manage_events (channel_t * src, uint32_t events);
+static void channel_update_listed (channel_t * c);
 
 ACQUIRE_STRUCT_DECL (tunnel_t);
+RELEASE_STRUCT_DECL (tunnel_t);
 PURGE_STRUCT_DECL (tunnel_t);
 DRAIN_STRUCT_DECL (tunnel_t);
 
 static tunnel_t *tunnel_reserve (proxy_t * proxy);
 static void tunnel_init (tunnel_t * t);
 static void tunnel_release (tunnel_t * t);
+static void tunnel_recycle (tunnel_t * t);
 static void tunnel_unref (tunnel_t * t);
-static void tunnel_abort (tunnel_t * t, const char *fmt, ...);
+static void tunnel_abort (tunnel_t * t, enum metrics_abort_e why, int err);
+static void tunnel_failover (tunnel_t * t, int err);
+static void tunnel_arm (tunnel_t * t);
+static int tunnel_offload (tunnel_t * t);
+static int tunnel_fastopened (tunnel_t * t);
+
+static void feed_register (feed_t * f);
 
 static void proxy_register (proxy_t * p);
 static void proxy_pause (proxy_t * p);
 static void proxy_resume (proxy_t * p);
+static void proxy_throttle (proxy_t * p);
+
+static struct io_uring_sqe *ring_sqe (void);
 
 /* -------------------------------------------------------------------------- */
 
@@ -198,10 +528,41 @@ _flags2str (uint32_t status, char *d0)
         add ('E');
     if (status & FLAG_REGISTERED)
         add ('R');
+    if (status & FLAG_PAUSED)
+        add ('P');
+    if (status & FLAG_THROTTLED)
+        add ('T');
     return d0;
 }
 #endif
 
+static void
+pipe_close (pipe_t * p)
+{
+    close (p->fd[0]);
+    close (p->fd[1]);
+    p->fd[0] = p->fd[1] = -1;
+    --metrics->pipes_open;
+    metrics->pipe_bytes -= p->size;
+    p->size = 0;
+}
+
+// The kernel rounds <size> up to a power of 2 of pages, and refuses to
+// shrink a pipe below its load.
+static void
+pipe_resize (pipe_t * p, int size)
+{
+    int rc = fcntl (p->fd[1], F_SETPIPE_SZ, size);
+
+    if (rc < 0 || rc == p->size)
+        return;
+    metrics->pipe_bytes += rc - p->size;
+    p->size = rc;
+    ++metrics->pipe_resizes;
+}
+
+// A pipe still loaded cannot be reused. The idle ones are kept open, in
+// the limits of the watermarks of the slab and of <opt_pipe_pool> bytes.
 static void
 pipe_release (pipe_t ** pp)
 {
@@ -209,31 +570,142 @@ pipe_release (pipe_t ** pp)
 
     if (!p)
         return;
-    if (p->load > 0) {
-        close (p->fd[0]);
-        close (p->fd[1]);
-        p->fd[0] = p->fd[1] = -1;
-        p->load = 0;
+    --metrics->pipes_used;
+    if (p->fd[0] > 0) {
+        if (p->load > 0
+            || metrics->pipe_idle_bytes + p->size > (uint64_t) opt_pipe_pool)
+            pipe_close (p);
+        else
+            metrics->pipe_idle_bytes += p->size;
     }
-    PREPEND_STRUCT (IDLE_STRUCT_NAME (pipe_t), p);
+    p->load = p->peak = 0;
+    RELEASE_STRUCT_CALL (pipe_t, p);
     *pp = NULL;
 }
 
+// An idle pipe handed back to its slab keeps no descriptor
+static void
+pipe_fini (void *ptr)
+{
+    pipe_t *p = ptr;
+
+    if (p->fd[0] > 0) {
+        metrics->pipe_idle_bytes -= p->size;
+        pipe_close (p);
+    }
+}
+
+// A pipe of <size> bytes, or larger: the pipes of the pool are only
+// shrunk when they are much too large, to avoid resizing them back and
+// forth between the small and the bulk tunnels.
 static pipe_t *
-pipe_init ()
+pipe_init (int size)
 {
     pipe_t *p = ACQUIRE_STRUCT_CALL (pipe_t);
 
-    if (p->fd[0] <= 0 && p->fd[1] <= 0) {
-        if (0 > pipe2 (p->fd, SOCK_NONBLOCK | SOCK_CLOEXEC)) {
-            pipe_release (&p);
-            return NULL;
-        }
-        fcntl (p->fd[1], F_SETPIPE_SZ, PIPE_SIZE);
+    ++metrics->pipes_used;
+    if (p->fd[0] > 0) {
+        metrics->pipe_idle_bytes -= p->size;
+        if (p->size < size || p->size > size * PIPE_GROWTH)
+            pipe_resize (p, size);
+        return p;
+    }
+    if (0 > pipe2 (p->fd, SOCK_NONBLOCK | SOCK_CLOEXEC)) {
+        pipe_release (&p);
+        return NULL;
     }
+    if (0 > (p->size = fcntl (p->fd[1], F_SETPIPE_SZ, size)))
+        p->size = fcntl (p->fd[1], F_GETPIPE_SZ);
+    ++metrics->pipes_open;
+    metrics->pipe_bytes += p->size;
     return p;
 }
 
+// Called when the pipe <p> filled from <src> has been drained
+static void
+pipe_drained (channel_t * src, pipe_t * p)
+{
+    if (p->peak * 4 > src->pipe_want) {
+        src->pipe_calm = 0;
+        return;
+    }
+    if (++src->pipe_calm >= PIPE_CALM && src->pipe_want > opt_pipe_min) {
+        src->pipe_want /= 2;
+        src->pipe_calm = 0;
+    }
+}
+
+// Prefill the pool with open pipes, at the smallest size
+static void
+pipe_prewarm (void)
+{
+    pipe_t *warm = NULL, *p;
+
+    for (int i = 0; i < opt_pipe_prewarm && (p = pipe_init (opt_pipe_min));
+        ++i)
+        PREPEND_STRUCT (warm, p);
+    while (warm) {
+        SHIFT_STRUCT (warm, p);
+        pipe_release (&p);
+    }
+}
+
+enum budget_level_e
+{
+    BUDGET_OK = 0,
+    BUDGET_LEAN,                // beyond 3/4, the new tunnels are lean
+    BUDGET_FULL,                // no room for a lean tunnel, accepts paused
+};
+
+// Buffers the kernel may commit to the two sockets of a tunnel. It
+// doubles the sizes set with SO_RCVBUF and SO_SNDBUF for its bookkeeping,
+// and the sockets left to autotuning start from the defaults of tcp_rmem
+// and tcp_wmem: only an estimate, the queues are charged as they fill.
+static uint64_t
+tunnel_sockbufs (int lean)
+{
+    if (lean)
+        return 2 * 2 * 2 * (uint64_t) opt_buffer_lean;
+    if (opt_buffer_size)
+        return 2 * 2 * (uint64_t) (PIPE_SIZE / 2 + PIPE_SIZE);
+    return 2 * (uint64_t) (sockbuf_rcv_default + sockbuf_snd_default);
+}
+
+// Memory committed to the tunnels of the event loop: the arenas of the
+// slabs, the capacity of the open pipes and the buffers of the sockets.
+static uint64_t
+budget_used (void)
+{
+    return metrics->slab.bytes + metrics->pipe_bytes + metrics->sockbuf_bytes;
+}
+
+// Existing tunnels do not grow their pipes beyond the budget
+static int
+budget_tight (void)
+{
+    return budget && budget_used () >= budget;
+}
+
+static int
+budget_level (proxy_t * p)
+{
+    if (!budget)
+        return BUDGET_OK;
+
+    uint64_t used = budget_used ();
+    uint64_t lean = sizeof (tunnel_t) + tunnel_sockbufs (1) + 2 * opt_pipe_min;
+    uint64_t full = sizeof (tunnel_t) + tunnel_sockbufs (0) + 2 * opt_pipe_min;
+    // Once paused, wait for some room so as not to flap at the limit
+    uint64_t limit = ISANY (p->flags, FLAG_PAUSED) ? budget - budget / 8
+        : budget;
+
+    if (used + lean > limit)
+        return BUDGET_FULL;
+    if (used + full > budget - budget / 4)
+        return BUDGET_LEAN;
+    return BUDGET_OK;
+}
+
 // Return a boolean value, FALSE if an error occured, TRUE if no socket
 // error was met.
 static void
@@ -243,13 +715,18 @@ _pipe_resume (channel_t * chan)
 
     chan->tosend = NULL;
     while (p->load) {
+        // No SPLICE_F_MORE here: it would cork the last segment until the
+        // peer sends an ACK, and small replies would stall.
         int rc = splice (p->fd[0], 0, chan->sock, 0, p->load,
-            SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
 
         if (rc < 0) {
             chan->events &= ~EPOLLOUT;
-            if (errno == EAGAIN)
+            if (errno == EAGAIN) {
+                ++metrics->splice_eagain;
+                chan->ready &= ~EPOLLOUT;
                 chan->tosend = p;
+            }
             else {
                 chan->flags |= FLAG_ERRONEOUS;
                 pipe_release (&p);
@@ -258,9 +735,285 @@ _pipe_resume (channel_t * chan)
         }
         p->load -= rc;
     }
+    pipe_drained (chan->peer, p);
     pipe_release (&p);
 }
 
+static struct io_uring_sqe *
+ring_sqe (void)
+{
+    struct io_uring_sqe *sqe = uring_sqe (&ring);
+
+    if (!sqe) {
+        LOG ("io_uring_enter() failed : (%d) %s", errno, strerror (errno));
+        exit (-1);
+    }
+    return sqe;
+}
+
+// Cancel the operations still pending on the socket, then close it.
+// The tunnel cannot be recycled until their completions have been
+// received, see channel_manage_completion().
+static void
+ring_close (channel_t * chan)
+{
+    struct io_uring_sqe *sqe;
+
+    if (chan->inflight) {
+        sqe = ring_sqe ();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = chan->sock;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        sqe->flags = IOSQE_IO_HARDLINK;
+        sqe->user_data = UD_NONE;
+    }
+    sqe = ring_sqe ();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = chan->sock;
+    sqe->user_data = UD_NONE;
+}
+
+/* -------------------------------------------------------------------------- */
+
+static int64_t
+bucket_burst (int rate)
+{
+    int64_t burst = (int64_t) rate * opt_rate_burst / 1000;
+
+    return (burst > 0) ? burst : 1;
+}
+
+static void
+bucket_init (struct bucket_s *b, int rate)
+{
+    b->tokens = bucket_burst (rate);
+    b->stamp = now_ms;
+}
+
+// Refill the bucket for the time elapsed, and return the tokens available.
+// The stamp is only moved when tokens are added, so that the slow rates
+// are not lost in the rounding.
+static int64_t
+bucket_refill (struct bucket_s *b, int rate)
+{
+    int64_t add, burst = bucket_burst (rate);
+
+    if (now_ms > b->stamp) {
+        add = (int64_t) (now_ms - b->stamp) * rate / 1000;
+        if (add > 0 || b->tokens >= burst) {
+            b->tokens += add;
+            b->stamp = now_ms;
+        }
+        if (b->tokens > burst)
+            b->tokens = burst;
+    }
+    return b->tokens;
+}
+
+#define SHAPED(t) (opt_rate_tunnel > 0 || (t)->client || global_rate > 0)
+
+// Return how many bytes the tunnel may transfer now, or 0 if one of its
+// buckets is empty. Then <*delay> is set to the time to wait for it to be
+// refilled.
+static size_t
+shaper_allow (tunnel_t * t, uint64_t * delay)
+{
+    int64_t allowed = PIPE_SIZE;
+    uint64_t wait = 0;
+
+    void check (struct bucket_s *b, int rate)
+    {
+        int64_t n = bucket_refill (b, rate);
+
+        if (n <= 0) {
+            uint64_t d = (uint64_t) (-n) * 1000 / rate + 1;
+
+            if (d > wait)
+                wait = d;
+        }
+        else if (n < allowed) {
+            allowed = n;
+        }
+    }
+    if (opt_rate_tunnel > 0)
+        check (&t->bucket, opt_rate_tunnel);
+    if (t->client)
+        check (&t->client->bucket, opt_rate_client);
+    if (global_rate > 0)
+        check (&global_bucket, global_rate);
+
+    *delay = wait;
+    return wait ? 0 : (size_t) allowed;
+}
+
+static void
+shaper_consume (tunnel_t * t, size_t len)
+{
+    if (opt_rate_tunnel > 0)
+        t->bucket.tokens -= len;
+    if (t->client)
+        t->client->bucket.tokens -= len;
+    if (global_rate > 0)
+        global_bucket.tokens -= len;
+}
+
+// The IPv4 clients of a dual-stack front come as mapped addresses, they
+// are grouped by /24 as well.
+static unsigned int
+client_key (const struct sockaddr *sa, uint8_t * key)
+{
+    const struct in6_addr *a6 = &S6 (sa)->sin6_addr;
+    unsigned int h = 2166136261u;
+
+    memset (key, 0, 9);
+    if (SAFAM (sa) == AF_INET) {
+        key[0] = 4;
+        memcpy (key + 1, &S4 (sa)->sin_addr, 3);
+    }
+    else if (IN6_IS_ADDR_V4MAPPED (a6)) {
+        key[0] = 4;
+        memcpy (key + 1, a6->s6_addr + 12, 3);
+    }
+    else {
+        key[0] = 6;
+        memcpy (key + 1, a6->s6_addr, 8);
+    }
+    for (int i = 0; i < 9; ++i)
+        h = (h ^ key[i]) * 16777619u;
+    return h % CLIENT_SLOTS;
+}
+
+static client_t *
+client_ref (const struct sockaddr *sa)
+{
+    uint8_t key[9];
+    unsigned int slot = client_key (sa, key);
+    client_t *c;
+
+    for (c = clients[slot]; c; c = c->next) {
+        if (!memcmp (c->key, key, sizeof (key)))
+            break;
+    }
+    if (!c) {
+        c = ACQUIRE_STRUCT_CALL (client_t);
+        memcpy (c->key, key, sizeof (key));
+        c->refs = 0;
+        c->slot = slot;
+        bucket_init (&c->bucket, opt_rate_client);
+        PREPEND_STRUCT (clients[slot], c);
+    }
+    ++c->refs;
+    return c;
+}
+
+static void
+client_unref (client_t * c)
+{
+    client_t **pc;
+
+    if (--c->refs)
+        return;
+    for (pc = clients + c->slot; *pc != c; pc = &(*pc)->next);
+    *pc = c->next;
+    RELEASE_STRUCT_CALL (client_t, c);
+}
+
+// FNV-1a of the address and the port of a backend
+static unsigned int
+backend_hash (const struct sockaddr_in6 *to)
+{
+    const uint8_t *b = (const uint8_t *) SABUF (to);
+    unsigned int h = 2166136261u, len = (SAFAM (to) == AF_INET) ? 4 : 16;
+
+    for (unsigned int i = 0; i < len; ++i)
+        h = (h ^ b[i]) * 16777619u;
+    return (h ^ SAPRT (to)) * 16777619u;
+}
+
+static int
+backend_same (const struct sockaddr_in6 *a, const struct sockaddr_in6 *b)
+{
+    return SAFAM (a) == SAFAM (b) && SAPRT (a) == SAPRT (b)
+        && !memcmp (SABUF (a), SABUF (b), (SAFAM (a) == AF_INET) ? 4 : 16);
+}
+
+// The entry of the backend <to>, created if needed. NULL when the table
+// is too loaded, the backend then goes unreported for the period.
+static struct backend_s *
+backend_stat (const struct sockaddr_in6 *to)
+{
+    unsigned int i = backend_hash (to) % BACKEND_SLOTS;
+
+    for (;; i = (i + 1) % BACKEND_SLOTS) {
+        struct backend_s *b = backends + i;
+
+        if (SAFAM (&b->to) == AF_UNSPEC) {
+            if (backends_count >= BACKEND_SLOTS * 3 / 4)
+                return NULL;
+            ++backends_count;
+            memset (b, 0, sizeof (*b));
+            b->to = *to;
+            return b;
+        }
+        if (backend_same (&b->to, to))
+            return b;
+    }
+}
+
+// The latency of a warm connection is not known, only its use
+static void
+backend_connected (tunnel_t * t)
+{
+    struct backend_s *b = backend_stat (&t->to);
+
+    if (!b)
+        return;
+    ++b->connects;
+    ++b->active;
+    t->active = 1;
+    if (!t->warm) {
+        b->latency += now_us - t->dialed;
+        ++b->timed;
+    }
+}
+
+static void
+backend_failed (const struct sockaddr_in6 *to)
+{
+    struct backend_s *b = backend_stat (to);
+
+    if (b)
+        ++b->failures;
+}
+
+static void
+backend_closed (tunnel_t * t)
+{
+    struct backend_s *b = backend_stat (&t->to);
+
+    if (b && b->active)
+        --b->active;
+    t->active = 0;
+}
+
+// The channel stops reading until its buckets are refilled, it is not
+// monitored for EPOLLIN meanwhile.
+static void
+channel_throttle (channel_t * c, uint64_t delay)
+{
+    c->flags |= FLAG_THROTTLED;
+    c->events &= ~EPOLLIN;
+    wheel_add (&timers, &c->timer, now_ms + delay);
+}
+
+static void
+channel_expired (channel_t * c)
+{
+    c->flags &= ~FLAG_THROTTLED;
+    if (c->status && ISLISTED (c))
+        channel_update_listed (c);
+}
+
 /* -------------------------------------------------------------------------- */
 
 static void
@@ -268,14 +1021,32 @@ channel_close (channel_t * chan)
 {
     if (chan->sock < 0)
         return;
-    if (ISMONITORED (chan))
+    // The edge-triggered registrations are counted until the close
+    if (opt_engine == ENGINE_EDGE ? ISREGISTERED (chan) : ISMONITORED (chan))
         --count_epoll;
-    close (chan->sock);
+    if (opt_engine == ENGINE_URING)
+        ring_close (chan);
+    else
+        close (chan->sock);
     chan->sock = -1;
-    chan->flags = chan->events = 0;
+    chan->flags = chan->events = chan->ready = 0;
     pipe_release (&chan->tosend);
 }
 
+// Whether all that the offloaded <src> received has been written to its
+// peer, either acknowledged or still in its send queue.
+static int
+channel_drained (channel_t * src)
+{
+    channel_t *dst = src->peer;
+    int inq = 0;
+
+    if (0 == ioctl (src->sock, FIONREAD, &inq) && inq > 0)
+        return 0;
+    return sockmap_written (dst->sock) - dst->written
+        >= sockmap_bytes (&sockmap, src->cookie);
+}
+
 static void
 channel_shut (channel_t * chan)
 {
@@ -283,28 +1054,140 @@ channel_shut (channel_t * chan)
         return;
     if (chan->tosend)
         return;
+    if (chan->tunnel->offloaded && !channel_drained (chan->peer))
+        return tunnel_arm (chan->tunnel);
     chan->flags |= FLAG_SHUT_SENT;
     shutdown (chan->sock, SHUT_WR);
     chan->events &= ~EPOLLOUT;
     pipe_release (&chan->tosend);
 }
 
+// Count the <rc> bytes read from <src>
+static void
+channel_account (channel_t * src, int rc)
+{
+    tunnel_t *t = src->tunnel;
+
+    if (src == &t->front) {
+        metrics->bytes_up += rc;
+        t->bytes_up += rc;
+        if (!t->stamps.first_up) {
+            t->stamps.first_up = now_us;
+            hist_record (metrics->hist + HIST_FIRST_UP,
+                now_us - t->stamps.accepted);
+        }
+    }
+    else {
+        metrics->bytes_down += rc;
+        t->bytes_down += rc;
+        if (!t->stamps.first_down) {
+            t->stamps.first_down = now_us;
+            hist_record (metrics->hist + HIST_FIRST_DOWN,
+                now_us - t->stamps.connected);
+        }
+    }
+    if (SHAPED (t))
+        shaper_consume (t, rc);
+}
+
+// Each direction is copied while its reads average below <copy_max>
+// bytes, and spliced beyond, or as soon as a read fills the buffer. It
+// only returns to the copies below half of it.
+static void
+channel_chunk (channel_t * src, int rc, int full)
+{
+    src->chunk += (rc - src->chunk) / 8;
+    if (src->copying && (full || src->chunk >= opt_copy_max)) {
+        src->copying = 0;
+        ++metrics->path_switches;
+    }
+    else if (!src->copying && src->chunk < opt_copy_max / 2) {
+        src->copying = 1;
+        ++metrics->path_switches;
+    }
+}
+
+// A small read is copied to the peer at once, without a pipe. Only what
+// the peer does not accept is moved to a pipe, to be spliced later.
+static void
+channel_copy (channel_t * src, size_t len)
+{
+    channel_t *dst = src->peer;
+    ssize_t rc, sent;
+    pipe_t *p;
+
+    if (len > COPY_SIZE)
+        len = COPY_SIZE;
+    rc = recv (src->sock, copy_buf, len, MSG_DONTWAIT);
+    if (rc == 0) {
+        src->events &= ~EPOLLIN;
+        src->flags |= FLAG_SHUT_RECV;
+        return;
+    }
+    if (rc < 0) {
+        src->events &= ~EPOLLIN;
+        if (errno != EAGAIN)
+            src->flags |= FLAG_ERRONEOUS;
+        else
+            src->ready &= ~EPOLLIN;
+        return;
+    }
+
+    ++metrics->copies;
+    channel_account (src, rc);
+    channel_chunk (src, rc, rc == COPY_SIZE);
+
+    sent = send (dst->sock, copy_buf, rc, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno != EAGAIN) {
+            dst->flags |= FLAG_ERRONEOUS;
+            return;
+        }
+        dst->ready &= ~EPOLLOUT;
+        sent = 0;
+    }
+    if (sent == rc)
+        return;
+
+    ++metrics->copy_spills;
+    if (!(p = pipe_init (src->pipe_want))
+        || rc - sent != write (p->fd[1], copy_buf + sent, rc - sent)) {
+        pipe_release (&p);
+        src->flags |= FLAG_ERRONEOUS;
+        return;
+    }
+    p->load = p->peak = rc - sent;
+    dst->events &= ~EPOLLOUT;
+    dst->tosend = p;
+}
+
 static void
 channel_transfer (channel_t * src)
 {
     src->flags &= ~FLAG_ACTIVITY;
 
+    size_t len = PIPE_SIZE;
+    uint64_t delay;
+
+    if (SHAPED (src->tunnel) && !(len = shaper_allow (src->tunnel, &delay)))
+        return channel_throttle (src, delay);
+
+    // Behind the data already in a pipe, the order is kept
+    if (src->copying && !src->peer->tosend)
+        return channel_copy (src, len);
+
     pipe_t *p;
 
     if (!(p = src->peer->tosend))
-        p = pipe_init ();
+        p = pipe_init (src->pipe_want);
     src->peer->tosend = NULL;
     if (!p) {
         src->flags |= FLAG_ERRONEOUS;
         return;
     }
 
-    int rc = splice (src->sock, 0, p->fd[1], 0, PIPE_SIZE,
+    int empty = !p->load;
+    int rc = splice (src->sock, 0, p->fd[1], 0, len,
         SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
 
     if (rc == 0) {
@@ -315,9 +1198,28 @@ channel_transfer (channel_t * src)
         src->events &= ~EPOLLIN;
         if (errno != EAGAIN)
             src->flags |= FLAG_ERRONEOUS;
+        else {
+            src->ready &= ~EPOLLIN;
+            ++metrics->splice_eagain;
+        }
     }
     else {
+        tunnel_t *t = src->tunnel;
+
         p->load += rc;
+        if (p->load > p->peak)
+            p->peak = p->load;
+        channel_chunk (src, rc, 0);
+        // More was readable than the pipe could hold
+        if (empty && p->load >= p->size && src->pipe_want < opt_pipe_max
+            && !t->lean && !budget_tight ()) {
+            src->pipe_want *= PIPE_GROWTH;
+            if (src->pipe_want > opt_pipe_max)
+                src->pipe_want = opt_pipe_max;
+            src->pipe_calm = 0;
+            pipe_resize (p, src->pipe_want);
+        }
+        channel_account (src, rc);
     }
 
     if (p->load <= 0)
@@ -326,23 +1228,135 @@ channel_transfer (channel_t * src)
     return _pipe_resume (src->peer);
 }
 
+// With io_uring, a pending POLL_ADD plays the role of the armed
+// EPOLLONESHOT registration, and its mask is updated in place.
 static void
-channel_rearm (channel_t * chan, uint32_t io)
+channel_rearm_ring (channel_t * chan, uint32_t io)
 {
-    struct epoll_event evt;
-    int rc;
+    struct io_uring_sqe *sqe;
 
-    evt.data.ptr = chan;
-    evt.events = io | EPOLLET | EPOLLONESHOT;
+    if (ISMONITORED (chan)) {
+        if (io != chan->events) {
+            sqe = ring_sqe ();
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = UD (chan, UD_POLL);
+            sqe->len = IORING_POLL_UPDATE_EVENTS;
+            sqe->poll32_events = io;
+            sqe->user_data = UD_NONE;
+        }
+    }
+    else {
+        sqe = ring_sqe ();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = chan->sock;
+        sqe->poll32_events = io;
+        sqe->user_data = UD (chan, UD_POLL);
+        ++chan->inflight;
+        ++count_epoll;
+    }
 
-    if (FLAG_SHUT_BOTH == (chan->flags & FLAG_SHUT_BOTH)) {
-        if (ISMONITORED (chan))
-            --count_epoll;
-        if (ISREGISTERED (chan)) {
-retry:
-            rc = epoll_ctl (fd_epoll, EPOLL_CTL_DEL, chan->sock, NULL);
-            if (rc < 0) {
-                if (errno == EINTR)
+    chan->events = io;
+    chan->flags = SETONE (chan->flags, FLAG_LISTED | FLAG_ACTIVITY,
+        FLAG_MONITORED | FLAG_REGISTERED);
+}
+
+static void
+channel_connect_ring (channel_t * chan)
+{
+    struct io_uring_sqe *sqe = ring_sqe ();
+
+    sqe->opcode = IORING_OP_CONNECT;
+    sqe->fd = chan->sock;
+    sqe->addr = (uint64_t) (uintptr_t) & chan->tunnel->to;
+    sqe->off = SALEN (&chan->tunnel->to);
+    sqe->user_data = UD (chan, UD_CONNECT);
+    ++chan->inflight;
+    ++count_epoll;
+
+    chan->events = EPOLLOUT;
+    chan->flags = SETONE (chan->flags, FLAG_LISTED | FLAG_ACTIVITY,
+        FLAG_MONITORED | FLAG_REGISTERED);
+}
+
+// The socket is registered once, for both directions. A channel ready
+// already for what it waits for goes straight to the ACTIVE list, since
+// no other edge would come.
+static void
+channel_rearm_edge (channel_t * chan, uint32_t io)
+{
+    struct epoll_event evt;
+    uint32_t ready;
+
+    if (!ISREGISTERED (chan)) {
+        evt.data.ptr = chan;
+        evt.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ++metrics->epoll_ctls;
+        int rc = epoll_ctl (fd_epoll, EPOLL_CTL_ADD, chan->sock, &evt);
+
+        ASSERT (rc == 0);
+        (void) rc;
+        ++count_epoll;
+    }
+
+    // Already due, e.g. a failover timer raced with an edge
+    if (ISACTIVE (chan)) {
+        chan->events = io;
+        return;
+    }
+    if (0 != (ready = chan->ready & (io | EPOLLERR))) {
+        chan->events = ready;
+        chan->flags = SETACT (chan->flags) & ~FLAG_ACTIVITY;
+        chan->flags |= FLAG_REGISTERED;
+        PREPEND_STRUCT (ACTIVE_STRUCT_NAME (channel_t), chan);
+        return;
+    }
+    chan->events = io;
+    chan->flags = SETONE (chan->flags, FLAG_LISTED | FLAG_ACTIVITY,
+        FLAG_MONITORED | FLAG_REGISTERED);
+}
+
+// An edge on a socket registered by channel_rearm_edge(). The hangups
+// leave the socket readable, until the EOF is read.
+static void
+channel_edge (channel_t * c, uint32_t events)
+{
+    if (events & (EPOLLRDHUP | EPOLLHUP))
+        events |= EPOLLIN;
+    c->ready |= events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLERR);
+    if (!ISMONITORED (c))
+        return;
+    events = (events & EPOLLHUP) | (c->ready & (c->events | EPOLLERR));
+    if (!events)
+        return;
+    c->events = events;
+    c->flags = SETACT (c->flags) & ~FLAG_ACTIVITY;
+    PREPEND_STRUCT (ACTIVE_STRUCT_NAME (channel_t), c);
+}
+
+static void
+channel_rearm (channel_t * chan, uint32_t io)
+{
+    struct epoll_event evt;
+    int rc;
+
+    if (opt_engine == ENGINE_URING)
+        return channel_rearm_ring (chan, io);
+    if (opt_engine == ENGINE_EDGE)
+        return channel_rearm_edge (chan, io);
+
+    evt.data.ptr = chan;
+    evt.events = io | EPOLLET | EPOLLONESHOT;
+
+    if (FLAG_SHUT_BOTH == (chan->flags & FLAG_SHUT_BOTH)) {
+        if (ISMONITORED (chan))
+            --count_epoll;
+        if (ISREGISTERED (chan)) {
+retry:
+            ++metrics->epoll_ctls;
+            rc = epoll_ctl (fd_epoll, EPOLL_CTL_DEL, chan->sock, NULL);
+            if (rc < 0) {
+                if (errno == EINTR)
                     goto retry;
                 if (errno != ENOENT) {
                     ASSERT (rc == 0);
@@ -354,11 +1368,13 @@ retry:
 
     if (ISREGISTERED (chan)) {
         if (io != chan->events) {
+            ++metrics->epoll_ctls;
             rc = epoll_ctl (fd_epoll, EPOLL_CTL_MOD, chan->sock, &evt);
             ASSERT (rc == 0);
         }
     }
     else {
+        ++metrics->epoll_ctls;
         rc = epoll_ctl (fd_epoll, EPOLL_CTL_ADD, chan->sock, &evt);
         ASSERT (rc == 0);
     }
@@ -387,11 +1403,14 @@ channel_events (channel_t * c)
 {
     uint32_t evt = 0;
 
+    // Offloaded, only the hangups are left to the event loop
+    if (c->tunnel->offloaded)
+        return (c->flags & FLAG_SHUT_RECV) ? 0 : EPOLLRDHUP;
     if ((c->status == CONNECTING || c->tosend)
         && !(c->flags & FLAG_SHUT_SENT))
         evt |= EPOLLOUT;
     if (c->peer->status == CONNECTED && !(c->peer->flags & FLAG_SHUT_SENT)
-        && !(c->flags & FLAG_SHUT_RECV)
+        && !(c->flags & (FLAG_SHUT_RECV | FLAG_THROTTLED))
         && c->peer->tosend == NULL)
         evt |= EPOLLIN;
     return evt;
@@ -429,15 +1448,13 @@ channel_update (channel_t * c)
     channel_patch (c);
     channel_patch (c->peer);
     if (ISSHUT (c) && ISSHUT (c->peer))
-        return tunnel_release (c->tunnel);
-    if (ISERR (c))
-        return tunnel_abort (c->tunnel, "Peer error: %s", c->which);
-    if (ISERR (c->peer))
-        return tunnel_abort (c->tunnel, "Peer error: %s", c->which);
+        return tunnel_unref (c->tunnel);
+    if (ISERR (c) || ISERR (c->peer))
+        return tunnel_abort (c->tunnel, ABORT_PEER, 0);
 
     uint32_t evt = channel_events (c);
 
-    if (c->events & BOTH) {
+    if ((c->events & BOTH) && !c->tunnel->offloaded) {
         c->events = evt;
         c->flags = SETACT (c->flags) & ~FLAG_ACTIVITY;
         PREPEND_STRUCT (ACTIVE_STRUCT_NAME (channel_t), c);
@@ -462,14 +1479,31 @@ channel_manage_events (channel_t * c, uint32_t events)
         __FUNCTION__);
     ASSERT (!(c->flags & FLAG_LISTED));
 
-    if (events & EPOLLERR)
-        return tunnel_abort (c->tunnel, "Channel error: %s", c->which);
+    if (events & EPOLLERR) {
+        if (c->status == CONNECTING)
+            return tunnel_failover (c->tunnel, sock_get_error (c->sock));
+        return tunnel_abort (c->tunnel, ABORT_PEER, sock_get_error (c->sock));
+    }
 
     if (!c->status)             // Deleted!
         return;
+    c->tunnel->touched = now_ms;
     if (events & EPOLLOUT) {
         if (c->status == CONNECTING) {
+            tunnel_t *t = c->tunnel;
+
             c->status = CONNECTED;
+            t->stamps.connected = now_us;
+            hist_record (metrics->hist + HIST_CONNECT,
+                now_us - t->stamps.popped);
+            hist_record (metrics->hist + HIST_ESTABLISH,
+                now_us - t->stamps.accepted);
+            if (t->syn_data && 0 > tunnel_fastopened (t))
+                return tunnel_abort (t, ABORT_PEER, errno);
+            if (backends)
+                backend_connected (t);
+            if (sockmap_ready && !SHAPED (t) && 0 > tunnel_offload (t))
+                return tunnel_abort (t, ABORT_PEER, EPROTO);
             return channel_update (c);
         }
     }
@@ -479,11 +1513,46 @@ channel_manage_events (channel_t * c, uint32_t events)
     }
     if (events & EPOLLIN)
         channel_transfer (c);
-    if (events & EPOLLHUP)
+    // EPOLLRDHUP is only asked for by the offloaded channels, but epoll
+    // always reports EPOLLHUP, for the spliced channels too
+    if (events & (EPOLLHUP | EPOLLRDHUP))
         c->flags |= FLAG_SHUT_RECV;
     return channel_update (c);
 }
 
+// A completion from the ring is turned into the epoll events the state
+// machine expects, and the channel is made active.
+static void
+channel_manage_completion (channel_t * c, int tag, int res)
+{
+    DEBUG ("%llu %s %x tag=%d res=%d inflight=%u %s", c->tunnel->id, c->which,
+        c->status, tag, res, c->inflight, __FUNCTION__);
+    ASSERT (c->inflight > 0);
+    --c->inflight;
+
+    // The tunnel has been released meanwhile
+    if (!c->status)
+        return tunnel_recycle (c->tunnel);
+
+    ASSERT (ISMONITORED (c));
+    --count_epoll;
+    if (res < 0 && (tag == UD_CONNECT || c->status == CONNECTING)) {
+        c->flags &= ~FLAG_LISTED;
+        if (res == -EADDRNOTAVAIL)
+            ++metrics->port_exhaustions;
+        // Cancelled by tunnel_expired()
+        if (res == -ECANCELED)
+            res = -ETIMEDOUT;
+        return tunnel_failover (c->tunnel, -res);
+    }
+    if (tag == UD_CONNECT)
+        c->events = (res < 0) ? EPOLLERR : EPOLLOUT;
+    else
+        c->events = (res < 0) ? EPOLLERR : (uint32_t) res;
+    c->flags = SETACT (c->flags) & ~FLAG_ACTIVITY;
+    PREPEND_STRUCT (ACTIVE_STRUCT_NAME (channel_t), c);
+}
+
 /* -------------------------------------------------------------------------- */
 
 static void
@@ -496,11 +1565,37 @@ tunnel_init (tunnel_t * t)
     t->front.type = t->back.type = CHANNEL;
     t->front.status = t->back.status = 0;
     t->front.tosend = t->back.tosend = NULL;
+    t->front.ready = t->back.ready = 0;
+    t->front.pipe_want = t->back.pipe_want = opt_pipe_min;
+    t->front.pipe_calm = t->back.pipe_calm = 0;
+    t->front.chunk = t->back.chunk = 0;
+    t->front.copying = t->back.copying = (opt_copy_max > 0);
+    t->front.cookie = t->back.cookie = 0;
     t->front.next = t->back.next = NULL;
     t->front.peer = &t->back;
     t->back.peer = &t->front;
     t->back.which = "BACK";
     t->front.which = "FRONT";
+    t->attempts = 0;
+    t->failed_err = 0;
+    t->started = t->touched = now_ms;
+    t->client = NULL;
+    memset (&t->stamps, 0, sizeof (t->stamps));
+    t->stamps.accepted = now_us;
+    t->bytes_up = t->bytes_down = 0;
+    t->reason = 0;
+    t->err = 0;
+    t->offloaded = 0;
+    t->drains = 0;
+    t->relayed = 0;
+    t->syn_data = 0;
+    t->warm = 0;
+    t->active = 0;
+    t->dialed = 0;
+    t->timer.type = TUNNEL;
+    t->front.timer.type = t->back.timer.type = CHANNEL;
+    if (opt_rate_tunnel > 0)
+        bucket_init (&t->bucket, opt_rate_tunnel);
 }
 
 static tunnel_t *
@@ -514,13 +1609,84 @@ tunnel_reserve (proxy_t * proxy)
     return t;
 }
 
+// A released tunnel is only recycled when none of its channels is still
+// referenced by the ACTIVE list or by a pending io_uring operation.
+static void
+tunnel_recycle (tunnel_t * t)
+{
+    if (ISACTIVE (&t->front) || ISACTIVE (&t->back))
+        return;
+    if (t->front.inflight || t->back.inflight)
+        return;
+    RELEASE_STRUCT_CALL (tunnel_t, t);
+}
+
 static void
 tunnel_release (tunnel_t * t)
 {
+    uint32_t front = t->front.flags & FLAG_ACTIVE;
+    uint32_t back = t->back.flags & FLAG_ACTIVE;
+
+    wheel_del (&timers, &t->timer);
+    wheel_del (&timers, &t->front.timer);
+    wheel_del (&timers, &t->back.timer);
+    if (t->client) {
+        client_unref (t->client);
+        t->client = NULL;
+    }
     channel_close (&t->front);
     channel_close (&t->back);
-    tunnel_init (t);
-    PREPEND_STRUCT (IDLE_STRUCT_NAME (tunnel_t), t);
+    // The channels may still be linked in the ACTIVE list, so they are
+    // only reset when the tunnel is reserved again.
+    t->front.status = t->back.status = 0;
+    t->front.flags = front;
+    t->back.flags = back;
+    tunnel_recycle (t);
+}
+
+// The record is only copied in the ring, the writer thread formats it
+static void
+tunnel_log (tunnel_t * t)
+{
+    struct access_s a;
+
+    a.id = t->id;
+    a.from = t->from;
+    a.to = t->to;
+    a.accepted = t->stamps.accepted;
+    a.popped = t->stamps.popped;
+    a.connected = t->stamps.connected;
+    a.first_up = t->stamps.first_up;
+    a.first_down = t->stamps.first_down;
+    a.closed = now_us;
+    a.bytes_up = t->bytes_up;
+    a.bytes_down = t->bytes_down;
+    a.err = t->err;
+    a.reason = t->reason;
+    a.worker = main_worker_id;
+    a.failovers = t->attempts;
+    a.failed = t->failed;
+    a.failed_err = t->failed_err;
+    if (!access_push (access_ring, &a))
+        ++metrics->access_drops;
+}
+
+// The bytes the kernel forwarded are accounted once the tunnel closes
+static void
+tunnel_unload (tunnel_t * t)
+{
+    uint64_t up = sockmap_bytes (&sockmap, t->front.cookie);
+    uint64_t down = sockmap_bytes (&sockmap, t->back.cookie);
+
+    t->bytes_up += up;
+    t->bytes_down += down;
+    metrics->bytes_up += up;
+    metrics->bytes_down += down;
+    sockmap_del (&sockmap, t->front.cookie);
+    sockmap_del (&sockmap, t->back.cookie);
+    t->offloaded = 0;
+    --sockmap_count;
+    --metrics->offloaded;
 }
 
 static void
@@ -528,22 +1694,28 @@ tunnel_unref (tunnel_t * t)
 {
     proxy_t *p = t->proxy;
 
+    if (t->offloaded)
+        tunnel_unload (t);
+    if (t->active)
+        backend_closed (t);
+    if (access_ring)
+        tunnel_log (t);
+    hist_record (metrics->hist + HIST_LIFETIME, now_us - t->stamps.accepted);
+    metrics->sockbuf_bytes -= t->sockbufs;
     tunnel_release (t);
-    if (p->pipes.max == (p->pipes.count--))
-        proxy_resume (p);
+    --p->pipes.count;
+    --metrics->tunnels;
+    proxy_throttle (p);
 }
 
+// The reason is reported in the access log, nothing is formatted here
 static void
-tunnel_abort (tunnel_t * t, const char *fmt, ...)
+tunnel_abort (tunnel_t * t, enum metrics_abort_e why, int err)
 {
-    char buf[256];
-    va_list arg;
-
-    va_start (arg, fmt);
-    vsnprintf (buf, sizeof (buf), fmt, arg);
-    va_end (arg);
-
-    LOG ("Tunnel aborted: %s", buf);
+    ++metrics->aborts[why];
+    t->reason = 1 + why;
+    t->err = err;
+    DEBUG ("%llu aborted: %s (%d)", t->id, metrics_abort_names[why], err);
     tunnel_unref (t);
 }
 
@@ -554,19 +1726,374 @@ tunnel_register (tunnel_t * t)
     t->front.events = t->back.events = 0;
     t->back.status = CONNECTING;
     channel_rearm (&t->front, 0);
-    channel_rearm (&t->back, EPOLLOUT);
+    // A warm socket is only polled, connected or about to be
+    if (opt_engine == ENGINE_URING && !t->warm)
+        channel_connect_ring (&t->back);
+    else
+        channel_rearm (&t->back, EPOLLOUT);
+    t->deadline = now_ms + opt_connect_timeout;
+    tunnel_arm (t);
+}
+
+// What <c> received while its peer was not in the sockmap yet has been
+// passed to <c> itself, it is forwarded here unless the kernel already
+// redirected what followed it. Returns 0, or -1 if the order is lost.
+static int
+channel_rescue (channel_t * c)
+{
+    size_t rescued = 0;
+    ssize_t rc;
+
+    while (0 < (rc = recv (c->sock, copy_buf, COPY_SIZE, MSG_DONTWAIT))) {
+        if (rc != send (c->peer->sock, copy_buf, rc,
+                MSG_DONTWAIT | MSG_NOSIGNAL))
+            return -1;
+        channel_account (c, rc);
+        c->peer->written += rc;
+        rescued += rc;
+    }
+    if (rc < 0 && errno != EAGAIN)
+        return -1;
+    if (rescued && sockmap_bytes (&sockmap, c->cookie))
+        return -1;
+    return 0;
+}
+
+// Once both sides are connected, the kernel may forward the data of the
+// tunnel by itself, each socket redirecting what it receives to its peer,
+// and the event loop then only waits for the hangups. The tunnel is left
+// to the splice path when anything fails before its sockets are in the
+// sockmap. Returns 1 if offloaded, 0 if not, -1 if the tunnel is broken.
+static int
+tunnel_offload (tunnel_t * t)
+{
+    channel_t *f = &t->front, *b = &t->back;
+    struct epoll_event evt;
+    int one = 1;
+    char peek;
+
+    // E.g. a client that already sent its FIN
+    if (sockmap_count >= (unsigned int) opt_sockmap
+        || !sockmap_established (f->sock)
+        || !(f->cookie = sockmap_cookie (f->sock))
+        || !(b->cookie = sockmap_cookie (b->sock))
+        || 0 > sockmap_link (&sockmap, f->cookie, b->cookie)
+        || 0 > sockmap_link (&sockmap, b->cookie, f->cookie))
+        goto fallback;
+    f->written = sockmap_written (f->sock);
+    b->written = sockmap_written (b->sock);
+    // The backend first, the clients rarely wait before sending: what a
+    // socket already received is only redirected once kicked below.
+    if (0 > sockmap_add (&sockmap, b->sock, b->cookie))
+        goto fallback;
+
+    t->offloaded = 1;
+    ++sockmap_count;
+    ++metrics->offloaded;
+    ++metrics->offloads;
+    // E.g. the client half-closed since the check, the back socket is
+    // taken out and the tunnel stays spliced
+    if (0 > sockmap_add (&sockmap, f->sock, f->cookie)) {
+        t->offloaded = 0;
+        --sockmap_count;
+        --metrics->offloaded;
+        --metrics->offloads;
+        goto fallback;
+    }
+    setsockopt (f->sock, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof (one));
+    setsockopt (b->sock, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof (one));
+    if (0 < recv (f->sock, &peek, 1, MSG_PEEK | MSG_DONTWAIT)
+        || 0 > channel_rescue (b))
+        return -1;
+
+    // The edge-triggered registrations would report each write
+    if (opt_engine == ENGINE_EDGE) {
+        evt.events = EPOLLRDHUP | EPOLLET;
+        evt.data.ptr = f;
+        metrics->epoll_ctls += 2;
+        if (0 > epoll_ctl (fd_epoll, EPOLL_CTL_MOD, f->sock, &evt))
+            return -1;
+        evt.data.ptr = b;
+        if (0 > epoll_ctl (fd_epoll, EPOLL_CTL_MOD, b->sock, &evt))
+            return -1;
+    }
+    return 1;
+
+fallback:
+    sockmap_del (&sockmap, f->cookie);
+    sockmap_del (&sockmap, b->cookie);
+    f->cookie = b->cookie = 0;
+    ++metrics->offload_fallbacks;
+    return 0;
+}
+
+// The single timer of a tunnel is armed at the nearest of its deadlines.
+// The activity on the channels only refreshes <touched>, so that there
+// is no timer to move on each event: the timer is rearmed lazily when it
+// expires too early.
+static void
+tunnel_arm (tunnel_t * t)
+{
+    uint64_t when = UINT64_MAX;
+
+    if (opt_connect_timeout > 0 && t->back.status == CONNECTING)
+        when = t->deadline;
+    if (opt_idle_timeout > 0 && t->touched + opt_idle_timeout < when)
+        when = t->touched + opt_idle_timeout;
+    if (opt_max_lifetime > 0 && t->started + opt_max_lifetime < when)
+        when = t->started + opt_max_lifetime;
+    if (t->offloaded && (DRAINING (&t->front) || DRAINING (&t->back))
+        && now_ms + (1u << t->drains) < when)
+        when = now_ms + (1u << t->drains);
+
+    if (when == UINT64_MAX)
+        wheel_del (&timers, &t->timer);
+    else
+        wheel_add (&timers, &t->timer, when);
+}
+
+static void
+tunnel_expired_connect (tunnel_t * t)
+{
+    // The connection completed meanwhile and is about to be managed
+    if (ISACTIVE (&t->back))
+        return wheel_add (&timers, &t->timer, now_ms + 1);
+
+    // The pending CONNECT will complete with -ECANCELED
+    if (opt_engine == ENGINE_URING && t->back.inflight) {
+        struct io_uring_sqe *sqe = ring_sqe ();
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = UD (&t->back, t->warm ? UD_POLL : UD_CONNECT);
+        sqe->user_data = UD_NONE;
+        return;
+    }
+
+    tunnel_failover (t, ETIMEDOUT);
+}
+
+// The bytes forwarded by the kernel since the last poll are activity, and
+// the FINs held back are forwarded once the data before them is written.
+// Returns 0 if the tunnel has been released.
+static int
+tunnel_poll_offload (tunnel_t * t)
+{
+    uint64_t relayed = sockmap_bytes (&sockmap, t->front.cookie)
+        + sockmap_bytes (&sockmap, t->back.cookie);
+
+    if (relayed != t->relayed) {
+        t->relayed = relayed;
+        t->touched = now_ms;
+    }
+    if (!DRAINING (&t->front) && !DRAINING (&t->back))
+        return 1;
+    if (t->drains < DRAIN_MAX)
+        ++t->drains;
+    if (DRAINING (&t->front))
+        channel_shut (&t->back);
+    if (DRAINING (&t->back))
+        channel_shut (&t->front);
+    if (ISSHUT (&t->front) && ISSHUT (&t->back)) {
+        tunnel_unref (t);
+        return 0;
+    }
+    return 1;
+}
+
+static void
+tunnel_expired (tunnel_t * t)
+{
+    if (opt_max_lifetime > 0 && now_ms >= t->started + opt_max_lifetime)
+        return tunnel_abort (t, ABORT_LIFETIME, 0);
+    if (t->offloaded && !tunnel_poll_offload (t))
+        return;
+    if (opt_connect_timeout > 0 && t->back.status == CONNECTING
+        && now_ms >= t->deadline)
+        return tunnel_expired_connect (t);
+    if (opt_idle_timeout > 0 && now_ms >= t->touched + opt_idle_timeout)
+        return tunnel_abort (t, ABORT_IDLE, 0);
+    tunnel_arm (t);
+}
+
+static void warm_purge (proxy_t * p);
+static void feed_expired (feed_t * f);
+
+static void
+timer_expired (struct wheel_timer_s *tm)
+{
+    if (tm->type == PROXY)
+        return warm_purge ((proxy_t *) ((char *) tm -
+                offsetof (proxy_t, warm.timer)));
+    if (tm->type == FEED)
+        return feed_expired ((feed_t *) ((char *) tm -
+                offsetof (feed_t, timer)));
+    if (tm->type == CHANNEL)
+        return channel_expired ((channel_t *) ((char *) tm -
+                offsetof (channel_t, timer)));
+    return tunnel_expired ((tunnel_t *) ((char *) tm -
+            offsetof (tunnel_t, timer)));
 }
 
 /* -------------------------------------------------------------------------- */
 
+#define FEED_COUNT(f) TOKEN_RING_COUNT (&(f)->tokens)
+#define FEED_SIZE(f)  TOKEN_RING_SIZE (&(f)->tokens)
+
+static void
+feed_register (feed_t * f)
+{
+    if (opt_engine == ENGINE_URING) {
+        struct io_uring_sqe *sqe = ring_sqe ();
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = f->fd;
+        sqe->poll32_events = EPOLLIN;
+        sqe->user_data = UD (f, UD_FEED);
+    }
+    else {
+        int op = ISREGISTERED (f) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        struct epoll_event evt;
+
+        evt.data.ptr = f;
+        evt.events = EPOLLET | EPOLLONESHOT | EPOLLIN;
+        ++metrics->epoll_ctls;
+        int rc = epoll_ctl (fd_epoll, op, f->fd, &evt);
+
+        ASSERT (rc == 0);
+        (void) rc;
+    }
+    ++count_epoll;
+    f->flags |= FLAG_REGISTERED | FLAG_MONITORED;
+}
+
+// Drain the nanomsg socket until the ring is full. The feed is monitored
+// again only if there is room left, otherwise feed_pop() will do it.
+static void
+feed_refill (feed_t * f)
+{
+    while (FEED_COUNT (f) < FEED_SIZE (f)) {
+        if (!f->tokens.msg.buf) {
+            int rc = nn_recv (f->nn, &f->tokens.msg.buf, NN_MSG, NN_DONTWAIT);
+
+            if (rc < 0) {
+                f->tokens.msg.buf = NULL;
+                break;
+            }
+            f->tokens.msg.len = rc;
+            f->tokens.msg.off = 0;
+        }
+        if (!token_ring_fill (&f->tokens)) {
+            nn_freemsg (f->tokens.msg.buf);
+            f->tokens.msg.buf = NULL;
+        }
+    }
+
+    if (FEED_COUNT (f) < FEED_SIZE (f))
+        feed_register (f);
+}
+
+static void
+feed_manage_event (feed_t * f)
+{
+    ASSERT (ISMONITORED (f));
+    f->flags &= ~FLAG_LISTED;
+    feed_refill (f);
+}
+
+// Return FALSE if no backend is available yet
+static int
+feed_pop (feed_t * f, struct sockaddr_in6 *to)
+{
+    if (!token_ring_pop (&f->tokens, to))
+        return 0;
+    if (!ISMONITORED (f) && FEED_COUNT (f) <= FEED_SIZE (f) / 2)
+        feed_register (f);
+    return 1;
+}
+
+static void
+feed_send (feed_t * f, uint8_t * msg, size_t len, unsigned int count)
+{
+    feedback_header (msg, count, f->sender);
+    if (0 > nn_send (f->fb, msg, len, NN_DONTWAIT))
+        ++metrics->feedback_drops;
+}
+
+// Push what the event loop observed of the backends during the period,
+// then start the next one with the backends that still have established
+// tunnels, so that the generators also learn when these are gone. A
+// message the generators do not take at once is dropped, the next period
+// will tell them.
+static void
+feed_expired (feed_t * f)
+{
+    uint8_t msg[FEEDBACK_HEADER + 1024 * FEEDBACK_RECORD];
+    struct backend_s *b, *old = backends;
+    struct feedback_s fb;
+    size_t len = FEEDBACK_HEADER;
+    unsigned int count = 0;
+
+    backends = backends_spare;
+    backends_spare = old;
+    memset (backends, 0, BACKEND_SLOTS * sizeof (*backends));
+    backends_count = 0;
+    for (unsigned int i = 0; i < BACKEND_SLOTS; ++i) {
+        b = old + i;
+        if (SAFAM (&b->to) == AF_UNSPEC
+            || !(b->connects || b->failures || b->active || b->carried))
+            continue;
+        if (sizeof (msg) - len < FEEDBACK_RECORD) {
+            feed_send (f, msg, len, count);
+            len = FEEDBACK_HEADER;
+            count = 0;
+        }
+        fb.addr = b->to;
+        fb.connects = b->connects;
+        fb.failures = b->failures;
+        fb.latency = b->timed ? b->latency / b->timed : 0;
+        fb.active = b->active;
+        len += feedback_encode (msg + len, sizeof (msg) - len, &fb);
+        ++count;
+        if (b->active) {
+            struct backend_s *next = backend_stat (&b->to);
+
+            next->active = b->active;
+            next->carried = 1;
+        }
+    }
+    if (count)
+        feed_send (f, msg, len, count);
+    wheel_add (&timers, &f->timer, now_ms + opt_feedback_period);
+}
+
+// A single multishot accept stays pending on the front socket, each new
+// client is delivered as a completion.
+static void
+proxy_register_ring (proxy_t * p)
+{
+    struct io_uring_sqe *sqe = ring_sqe ();
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = p->sock_front;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = UD (p, UD_ACCEPT);
+    ++count_epoll;
+    p->flags |= FLAG_REGISTERED | FLAG_MONITORED;
+}
+
 static void
 proxy_register (proxy_t * p)
 {
+    if (opt_engine == ENGINE_URING)
+        return proxy_register_ring (p);
+
     int op = ISREGISTERED (p) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     struct epoll_event evt;
 
     evt.data.ptr = p;
     evt.events = EPOLLET | EPOLLONESHOT | EPOLLIN;
+    ++metrics->epoll_ctls;
     int rc = epoll_ctl (fd_epoll, op, p->sock_front, &evt);
 
     ASSERT (rc == 0);
@@ -579,14 +2106,28 @@ proxy_register (proxy_t * p)
 static void
 proxy_pause (proxy_t * p)
 {
+    p->flags |= FLAG_PAUSED;
     p->events = 0;
     if (!ISMONITORED (p))
         return;
+
+    // The accept remains monitored until its last completion
+    if (opt_engine == ENGINE_URING) {
+        struct io_uring_sqe *sqe = ring_sqe ();
+
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = UD (p, UD_ACCEPT);
+        sqe->user_data = UD_NONE;
+        return;
+    }
+
     struct epoll_event evt;
 
     evt.data.ptr = p;
     evt.events = EPOLLET | EPOLLONESHOT;
 
+    ++metrics->epoll_ctls;
+
     int rc = epoll_ctl (fd_epoll, EPOLL_CTL_MOD, p->sock_front, &evt);
 
     ASSERT (rc == 0);
@@ -598,12 +2139,52 @@ proxy_pause (proxy_t * p)
 static void
 proxy_resume (proxy_t * p)
 {
+    p->flags &= ~FLAG_PAUSED;
+    // The accept being cancelled will be rearmed at its last completion
+    if (opt_engine == ENGINE_URING && ISLISTED (p)) {
+        p->events = EPOLLIN;
+        return;
+    }
     ASSERT (!(p->flags & FLAG_LISTED));
     p->flags |= FLAG_ACTIVE;
     p->events = EPOLLIN;
     PREPEND_STRUCT (ACTIVE_STRUCT_NAME (proxy_t), p);
 }
 
+// The accepts are paused when the proxy is saturated, either because
+// there are too many tunnels, too many of them are waiting for a backend
+// or the next one would exceed the memory budget, and resumed as soon as
+// it is not anymore.
+static int
+proxy_saturated (proxy_t * p)
+{
+    if (p->pipes.count >= p->pipes.max
+        || p->waiting.count >= (unsigned int) opt_pending)
+        return 1;
+    if (budget_level (p) < BUDGET_FULL)
+        return 0;
+    if (!ISANY (p->flags, FLAG_PAUSED))
+        ++metrics->budget_pauses;
+    return 1;
+}
+
+static void warm_yield (proxy_t * p);
+
+static void
+proxy_throttle (proxy_t * p)
+{
+    // The pool gives its room back before the accepts are paused
+    if (p->warm.count)
+        warm_yield (p);
+    if (!ISANY (p->flags, FLAG_PAUSED)) {
+        if (proxy_saturated (p))
+            proxy_pause (p);
+    }
+    else if (!proxy_saturated (p)) {
+        proxy_resume (p);
+    }
+}
+
 static void
 proxy_init (proxy_t * p)
 {
@@ -612,7 +2193,13 @@ proxy_init (proxy_t * p)
     p->events = 0;
     p->type = PROXY;
     p->sock_front = -1;
-    p->nn_feed = -1;
+    memset (&p->waiting, 0, sizeof (p->waiting));
+    memset (&p->feed, 0, sizeof (p->feed));
+    memset (&p->warm, 0, sizeof (p->warm));
+    p->warm.timer.type = PROXY;
+    p->feed.type = FEED;
+    p->feed.nn = p->feed.fd = p->feed.fb = -1;
+    p->feed.timer.type = FEED;
     struct rlimit rl;
 
     if (0 != getrlimit (RLIMIT_NOFILE, &rl))
@@ -621,17 +2208,28 @@ proxy_init (proxy_t * p)
     setrlimit (RLIMIT_NOFILE, &rl);
     p->pipes.count = 0;
     p->pipes.max = rl.rlim_max / 2;
+    // Threads share the same table of file descriptors
+    if (main_flags & MF_THREADS)
+        p->pipes.max /= main_workers;
+    // The descriptors still bound the cap of the connections
+    if (opt_max_conns > 0) {
+        unsigned int max = opt_max_conns / main_workers;
+
+        if (max < 1)
+            max = 1;
+        if (max < p->pipes.max)
+            p->pipes.max = max;
+    }
     LOG ("p.max = %d", p->pipes.max);
 
 }
 
+// Each worker binds its own listening socket on the same address, and
+// the kernel balances the incoming connections among them.
 static void
-proxy_init_front (proxy_t * p, char *front)
+proxy_init_front (proxy_t * p, const struct sockaddr *ss, const char *front)
 {
-    struct sockaddr_in6 ss;
-
-    sockaddr_init (SA (&ss), front);
-    p->sock_front = socket (SAFAM (&ss), SOCK_STREAM | O_NONBLOCK, 0);
+    p->sock_front = socket (SAFAM (ss), SOCK_STREAM | O_NONBLOCK, 0);
     ASSERT (p->sock_front >= 0);
 
     sock_set_chatty (p->sock_front, 1);
@@ -639,36 +2237,63 @@ proxy_init_front (proxy_t * p, char *front)
     int opt = 1;
 
     setsockopt (p->sock_front, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof (opt));
+    setsockopt (p->sock_front, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof (opt));
 
-    if (0 > bind (p->sock_front, SA (&ss), SALEN (&ss))) {
+    if (0 > bind (p->sock_front, SA (ss), SALEN (ss))) {
         LOG ("front(%d).bind(%s) failed", p->sock_front, front);
         exit (1);
     }
 
+    // The clients are only accepted with their first bytes, when they
+    // send some, and those with a cookie send them in their SYN.
+    if (opt_defer_accept > 0
+        && 0 > setsockopt (p->sock_front, SOL_TCP, TCP_DEFER_ACCEPT,
+            &opt_defer_accept, sizeof (opt_defer_accept)))
+        LOG ("front(%s) TCP_DEFER_ACCEPT failed : (%d) %s", front, errno,
+            strerror (errno));
+    if (opt_fastopen > 0
+        && 0 > setsockopt (p->sock_front, SOL_TCP, TCP_FASTOPEN,
+            &opt_fastopen, sizeof (opt_fastopen)))
+        LOG ("front(%s) TCP_FASTOPEN failed : (%d) %s", front, errno,
+            strerror (errno));
+
     LOG ("front(%s) ready", front);
 }
 
 static void
 proxy_init_feeders (proxy_t * p, char **feeds)
 {
+    feed_t *f = &p->feed;
+    size_t sz;
     int opt;
 
-    if (0 > (p->nn_feed = nn_socket (AF_SP, NN_PULL))) {
+    if (0 > (f->nn = nn_socket (AF_SP, NN_PULL))) {
         LOG ("feeder.socket() failed");
         exit (2);
     }
 
     opt = 32768;
-    nn_setsockopt (p->nn_feed, NN_SOL_SOCKET, NN_RCVBUF, &opt, sizeof (opt));
+    nn_setsockopt (f->nn, NN_SOL_SOCKET, NN_RCVBUF, &opt, sizeof (opt));
     opt = 1000;
-    nn_setsockopt (p->nn_feed, NN_SOL_SOCKET, NN_RECONNECT_IVL, &opt,
+    nn_setsockopt (f->nn, NN_SOL_SOCKET, NN_RECONNECT_IVL, &opt,
         sizeof (opt));
     opt = 1000;
-    nn_setsockopt (p->nn_feed, NN_SOL_SOCKET, NN_RECONNECT_IVL_MAX, &opt,
+    nn_setsockopt (f->nn, NN_SOL_SOCKET, NN_RECONNECT_IVL_MAX, &opt,
         sizeof (opt));
 
+    sz = sizeof (f->fd);
+    if (0 > nn_getsockopt (f->nn, NN_SOL_SOCKET, NN_RCVFD, &f->fd, &sz)) {
+        LOG ("feeder.getsockopt(RCVFD) failed");
+        exit (2);
+    }
+
+    if (!token_ring_init (&f->tokens, opt_tokens)) {
+        LOG ("tokens(%d) failed", opt_tokens);
+        exit (2);
+    }
+
     for (char **purl = feeds; *purl; ++purl) {
-        if (0 > nn_connect (p->nn_feed, *purl)) {
+        if (0 > nn_connect (f->nn, *purl)) {
             LOG ("feeder.connect(%s) failed", *purl);
             exit (2);
         }
@@ -676,14 +2301,462 @@ proxy_init_feeders (proxy_t * p, char **feeds)
             LOG ("feeder.connect(%s)", *purl);
         }
     }
+
+    if (!opt_feedback)
+        return;
+    if (0 > (f->fb = nn_socket (AF_SP, NN_PUSH))
+        || 0 > nn_connect (f->fb, opt_feedback)) {
+        LOG ("feedback.connect(%s) failed", opt_feedback);
+        exit (2);
+    }
+    if (sizeof (f->sender) != getrandom (&f->sender, sizeof (f->sender), 0))
+        f->sender = (getpid () << 8) ^ main_worker_id;
+    backends = calloc (BACKEND_SLOTS, sizeof (*backends));
+    backends_spare = calloc (BACKEND_SLOTS, sizeof (*backends));
+    ASSERT (backends != NULL && backends_spare != NULL);
+    wheel_add (&timers, &f->timer, now_ms + opt_feedback_period);
+}
+
+// The lean tunnels get small buffers, even when autotuning is asked for
+static void
+tunnel_set_buffers (tunnel_t * t, int sock)
+{
+    int rcv, snd;
+
+    if (t->lean)
+        rcv = snd = opt_buffer_lean;
+    else if (opt_buffer_size) {
+        rcv = PIPE_SIZE / 2;
+        snd = PIPE_SIZE;
+    }
+    else
+        return;
+    setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &rcv, sizeof (rcv));
+    setsockopt (sock, SOL_SOCKET, SO_SNDBUF, &snd, sizeof (snd));
+}
+
+// With -o fastopen, what the client already sent is peeked and carried by
+// the SYN toward the backend. It is only consumed once the connection is
+// established, so that a failover sends it again. Without a cookie for
+// the backend yet, or when the host disables TFO, the SYN goes alone.
+static int
+tunnel_connect_back (tunnel_t * t)
+{
+    ssize_t len, rc;
+
+    t->syn_data = 0;
+    if (opt_fastopen > 0
+        && 0 < (len = recv (t->front.sock, copy_buf, COPY_SIZE,
+                MSG_PEEK | MSG_DONTWAIT))) {
+        rc = sendto (t->back.sock, copy_buf, len,
+            MSG_FASTOPEN | MSG_NOSIGNAL, SA (&t->to), SALEN (&t->to));
+        if (rc > 0) {
+            t->syn_data = rc;
+            ++metrics->fastopens;
+            return 0;
+        }
+        if (errno != EOPNOTSUPP)
+            return -1;
+    }
+    return connect (t->back.sock, SA (&t->to), SALEN (&t->to));
+}
+
+// The bytes sent in the SYN are now in the send queue of the backend,
+// acknowledged or to be sent again by the kernel.
+static int
+tunnel_fastopened (tunnel_t * t)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof (ti);
+    ssize_t rc;
+
+    rc = recv (t->front.sock, copy_buf, t->syn_data, MSG_DONTWAIT);
+    if (rc != t->syn_data) {
+        errno = (rc < 0) ? errno : EPROTO;
+        return -1;
+    }
+    channel_account (&t->front, rc);
+    t->syn_data = 0;
+    if (0 == getsockopt (t->back.sock, SOL_TCP, TCP_INFO, &ti, &len)
+        && !(ti.tcpi_options & TCPI_OPT_SYN_DATA))
+        ++metrics->fastopen_misses;
+    return 0;
+}
+
+// Each backend cycles through the sources of its family, so that its
+// connections spread evenly on them, starting from where the previous
+// connection to a backend of the same slot stopped. NULL if none fits.
+static const struct sockaddr_in6 *
+source_pick (const struct sockaddr_in6 *to)
+{
+    unsigned int *next = source_next + backend_hash (to) % SOURCE_SLOTS;
+
+    for (unsigned int i = 0; i < sources_count; ++i) {
+        const struct sockaddr_in6 *src = sources + (*next)++ % sources_count;
+
+        if (SAFAM (src) == SAFAM (to))
+            return src;
+    }
+    return NULL;
+}
+
+// Bind a back socket to a source, the port being only chosen by the
+// connect() that knows the whole 4-tuple (IP_BIND_ADDRESS_NO_PORT).
+static int
+source_bind (int sock, const struct sockaddr_in6 *src)
+{
+    int one = 1;
+
+    if (!src)
+        return 0;
+    setsockopt (sock, SOL_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof (one));
+    return bind (sock, SA (src), SALEN (src));
+}
+
+// Open a socket toward <to> and start connecting it. For the back socket
+// of <t>, the SYN may carry what the client sent, and with io_uring the
+// connection is only started when the ring is submitted. When the source
+// has no port left toward the backend, the next sources are tried.
+// Returns the socket, or -1 with errno set.
+static int
+back_open (const struct sockaddr_in6 *to, tunnel_t * t)
+{
+    unsigned int tries = sources_count ? sources_count : 1;
+    int sock, rc, err = 0;
+
+    ++metrics->connects;
+    do {
+        if (0 > (sock = socket (SAFAM (to),
+                    SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+            return -1;
+        if (t)
+            t->back.sock = sock;
+        if (0 > source_bind (sock, source_pick (to)))
+            rc = -1;
+        else if (t && opt_engine == ENGINE_URING)
+            return sock;
+        else if (t)
+            rc = tunnel_connect_back (t);
+        else
+            rc = connect (sock, SA (to), SALEN (to));
+        if (rc == 0 || errno == EINPROGRESS)
+            return sock;
+        err = errno;
+        close (sock);
+        if (t)
+            t->back.sock = -1;
+        if (err != EADDRNOTAVAIL && err != EADDRINUSE)
+            break;
+        ++metrics->port_exhaustions;
+    } while (--tries > 0);
+    errno = err;
+    return -1;
+}
+
+// Buffers the kernel may commit to a pooled socket. The pool is charged
+// to the budget of the tunnels, until the socket is taken by one of them.
+static uint64_t
+warm_sockbufs (void)
+{
+    return tunnel_sockbufs (0) / 2;
+}
+
+static void
+warm_unpool (proxy_t * p, struct warm_s *w)
+{
+    w->sock = -1;
+    --p->warm.count;
+    --metrics->warm_pooled;
+    metrics->sockbuf_bytes -= warm_sockbufs ();
+}
+
+static void
+warm_drop (proxy_t * p, struct warm_s *w)
+{
+    close (w->sock);
+    warm_unpool (p, w);
+    ++metrics->warm_drops;
+}
+
+// Whether the pool may open one more connection: its descriptors and
+// buffers only take the room the admission of the tunnels leaves.
+static int
+warm_room (proxy_t * p)
+{
+    return p->pipes.count + p->warm.count + 1 < p->pipes.max
+        && budget_level (p) == BUDGET_OK;
+}
+
+// Close the oldest connections of the pool until the tunnels have their
+// descriptors and their memory back.
+static void
+warm_yield (proxy_t * p)
+{
+    struct warm_s *w;
+
+    for (unsigned int i = p->warm.head; p->warm.count
+        && (p->pipes.count + p->warm.count >= p->pipes.max
+            || budget_level (p) == BUDGET_FULL); ++i) {
+        w = p->warm.tab + (i & p->warm.mask);
+        if (w->sock >= 0)
+            warm_drop (p, w);
+    }
+}
+
+// Close the connections of the pool older than -o warm_age, from the
+// oldest, and forget the holes left by those taken meanwhile.
+static void
+warm_purge (proxy_t * p)
+{
+    struct warm_s *w;
+
+    for (; p->warm.head != p->warm.tail; ++p->warm.head) {
+        w = p->warm.tab + (p->warm.head & p->warm.mask);
+        if (w->sock < 0)
+            continue;
+        if (opt_warm_age <= 0)
+            return;
+        if (w->opened + opt_warm_age > now_ms)
+            return wheel_add (&timers, &p->warm.timer,
+                w->opened + opt_warm_age);
+        warm_drop (p, w);
+    }
+    wheel_del (&timers, &p->warm.timer);
+}
+
+// A connection of the pool toward <to>, or -1. The tokens being popped in
+// the order they were warmed up, the match is almost always the oldest
+// entry. A dead connection is only detected by a MSG_PEEK: one the
+// backend closed or reset meanwhile is dropped, but one still connecting,
+// or whose FIN or RST has not arrived yet, is handed over as is and fails
+// later, like a fresh connect.
+static int
+warm_take (proxy_t * p, const struct sockaddr_in6 *to)
+{
+    struct warm_s *w;
+    char peek;
+    int sock, rc;
+
+    if (!p->warm.count)
+        return -1;
+    warm_purge (p);
+    for (unsigned int i = p->warm.head; i != p->warm.tail; ++i) {
+        w = p->warm.tab + (i & p->warm.mask);
+        if (w->sock < 0 || SAFAM (&w->to) != SAFAM (to)
+            || SAPRT (&w->to) != SAPRT (to)
+            || memcmp (SABUF (&w->to), SABUF (to),
+                (SAFAM (to) == AF_INET) ? 4 : 16))
+            continue;
+        // A backend that spoke first is kept, its bytes go to the client
+        rc = recv (w->sock, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            warm_drop (p, w);
+            continue;
+        }
+        sock = w->sock;
+        warm_unpool (p, w);
+        ++metrics->warm_hits;
+        return sock;
+    }
+    return -1;
+}
+
+// Open connections toward the backends of the tokens not popped yet, in
+// their order, until the pool is full or has no more room.
+static void
+proxy_warm (proxy_t * p)
+{
+    feed_t *f = &p->feed;
+    struct warm_s *w;
+
+    if ((int) (p->warm.ahead - f->tokens.head) < 0)
+        p->warm.ahead = f->tokens.head;
+    while (p->warm.count < (unsigned int) opt_warm
+        && p->warm.ahead != f->tokens.tail
+        && p->warm.tail - p->warm.head <= p->warm.mask && warm_room (p)) {
+        w = p->warm.tab + (p->warm.tail & p->warm.mask);
+        w->to = f->tokens.tab[(p->warm.ahead++) & f->tokens.mask];
+        if (0 > (w->sock = back_open (&w->to, NULL)))
+            continue;
+        w->opened = now_ms;
+        if (p->warm.tail++ == p->warm.head && opt_warm_age > 0)
+            wheel_add (&timers, &p->warm.timer, now_ms + opt_warm_age);
+        ++p->warm.count;
+        ++metrics->warm_pooled;
+        metrics->sockbuf_bytes += warm_sockbufs ();
+    }
+}
+
+// Give the tunnel its back socket, from the pool or freshly opened.
+// Returns 0 or the errno of the failure.
+static int
+tunnel_open_back (tunnel_t * t)
+{
+    t->warm = 0;
+    t->dialed = now_us;
+    if (0 <= (t->back.sock = warm_take (t->proxy, &t->to)))
+        t->warm = 1;
+    else if (0 > back_open (&t->to, t))
+        return errno;
+
+    tunnel_set_buffers (t, t->back.sock);
+    if (opt_chatty_update)
+        sock_set_chatty (t->back.sock, opt_chatty_back);
+    return 0;
+}
+
+// The connection to the backend failed: the next backend is tried while
+// the front channel stays parked, until the budget of retries is spent.
+// The last failure is kept for the access log, nothing is formatted here.
+static void
+tunnel_failover (tunnel_t * t, int err)
+{
+    do {
+        if (backends)
+            backend_failed (&t->to);
+        if (t->attempts >= (unsigned int) opt_connect_retries)
+            return tunnel_abort (t, ABORT_CONNECT, err);
+        ++t->attempts;
+        ++metrics->failovers;
+        t->failed = t->to;
+        t->failed_err = err;
+        channel_close (&t->back);
+        if (!feed_pop (&t->proxy->feed, &t->to))
+            return tunnel_abort (t, ABORT_STARVATION, 0);
+    } while (0 != (err = tunnel_open_back (t)));
+
+    tunnel_register (t);
+}
+
+// Connect the tunnel to the backend it has been given
+static void
+tunnel_connect (tunnel_t * t)
+{
+    int err;
+
+    t->stamps.popped = now_us;
+    hist_record (metrics->hist + HIST_QUEUE, now_us - t->stamps.accepted);
+
+    // Tweak the socket options
+    tunnel_set_buffers (t, t->front.sock);
+    if (opt_chatty_update)
+        sock_set_chatty (t->front.sock, opt_chatty_front);
+
+    if (0 != (err = tunnel_open_back (t)))
+        return tunnel_failover (t, err);
+    errno = 0;
+    tunnel_register (t);
+}
+
+// Park the tunnel until a backend arrives on the feed. Its front socket
+// is not monitored meanwhile, the client just waits for its first bytes.
+static void
+proxy_defer (proxy_t * p, tunnel_t * t)
+{
+    t->deadline = now_ms + opt_pending_timeout;
+    t->next = NULL;
+    if (p->waiting.tail)
+        p->waiting.tail->next = t;
+    else
+        p->waiting.head = t;
+    p->waiting.tail = t;
+    ++p->waiting.count;
+    ++metrics->waiting;
+    ++metrics->starvations;
+}
+
+static tunnel_t *
+proxy_undefer (proxy_t * p)
+{
+    tunnel_t *t;
+
+    SHIFT_STRUCT (p->waiting.head, t);
+    if (!p->waiting.head)
+        p->waiting.tail = NULL;
+    --p->waiting.count;
+    --metrics->waiting;
+    return t;
+}
+
+// Give the backends just received to the waiting tunnels, in their order
+// of arrival, and abort those that waited for too long.
+static void
+proxy_manage_waiting (proxy_t * p)
+{
+    if (!p->waiting.head)
+        return;
+    while (p->waiting.head) {
+        if (feed_pop (&p->feed, &p->waiting.head->to)) {
+            tunnel_connect (proxy_undefer (p));
+            continue;
+        }
+        if (p->waiting.head->deadline > now_ms)
+            break;
+        tunnel_abort (proxy_undefer (p), ABORT_STARVATION, 0);
+    }
+    proxy_throttle (p);
+}
+
+// How long the event loop may sleep without missing a deadline of the
+// waiting tunnels or of the timers, -1 if there is none.
+static int
+proxy_timeout (proxy_t * p)
+{
+    int to = wheel_timeout (&timers);
+
+    if (!p->waiting.head)
+        return to;
+    if (p->waiting.head->deadline <= now_ms)
+        return 0;
+    if (to < 0 || p->waiting.head->deadline - now_ms < (uint64_t) to)
+        return p->waiting.head->deadline - now_ms;
+    return to;
+}
+
+// Start a tunnel for the client just accepted on <fd>
+static void
+proxy_accepted (proxy_t * p, int fd, struct sockaddr_in6 *from)
+{
+    tunnel_t *t = tunnel_reserve (p);
+
+    t->front.sock = fd;
+    t->from = *from;
+    if (opt_rate_client > 0)
+        t->client = client_ref (SA (from));
+    // Close to the budget, the buffers are shrunk rather than refused
+    t->lean = budget_level (p) >= BUDGET_LEAN;
+    t->sockbufs = tunnel_sockbufs (t->lean);
+    if (t->lean)
+        ++metrics->lean_admits;
+    metrics->sockbuf_bytes += t->sockbufs;
+    ++p->pipes.count;
+    ++metrics->accepts;
+    ++metrics->tunnels;
+
+    // Poll a backend, or wait for one if the feed is late. The waiting
+    // tunnels are served first, in their order of arrival.
+    if (p->waiting.head || !feed_pop (&p->feed, &t->to))
+        proxy_defer (p, t);
+    else
+        tunnel_connect (t);
+
+    // The proxy front socket is maybe still active. Then instead of
+    // systematically sending the proxy in ACTIVE, check if a limit
+    // has been reached. It it is, re-monitor for only errors.
+    if (proxy_saturated (p)) {
+        if (!ISANY (p->flags, FLAG_PAUSED))
+            proxy_pause (p);
+    }
+    else if (opt_engine != ENGINE_URING)
+        proxy_resume (p);
 }
 
 static void
 proxy_manage_event (proxy_t * p, uint32_t events)
 {
-    struct sockaddr_in6 from, to;
+    struct sockaddr_in6 from;
     socklen_t slen;
-    int fd, rc, opt;
+    int fd;
 
     (void) events;
     ASSERT (!(p->flags & FLAG_LISTED));
@@ -692,6 +2765,14 @@ proxy_manage_event (proxy_t * p, uint32_t events)
     if (!p->events)
         return;
 
+    // With io_uring the clients come as completions of the pending
+    // accept, there is only to rearm it.
+    if (opt_engine == ENGINE_URING) {
+        if (!ISMONITORED (p))
+            proxy_register (p);
+        return;
+    }
+
 retry:
     slen = sizeof (from);
     fd = accept4 (p->sock_front, SA (&from), &slen,
@@ -703,89 +2784,88 @@ retry:
         return proxy_register (p);
     }
 
-    tunnel_t *t = tunnel_reserve (p);
-
-    t->front.sock = fd;
-
-    // The proxy front socket is maybe still active. Then instead of
-    // systematically sending the proxy in ACTIVE, check if the limit
-    // has been reached. It it is, re-monitor for only errors.
-    if (p->pipes.max == ++(p->pipes.count))
-        proxy_pause (p);
-    else
-        proxy_resume (p);
-
-    // Poll a backend
-    void *buf = NULL;
+    proxy_accepted (p, fd, &from);
+}
 
-    rc = nn_recv (p->nn_feed, &buf, NN_MSG, NN_DONTWAIT);
-    if (rc < 0) {
-        // TODO better manage the backend's starvation (e.g. retry)
-        return tunnel_abort (t, "backend starvation: (%d) %s",
-            nn_errno (), nn_strerror (nn_errno ()));
-    }
-    else if (rc > 128) {
-        nn_freemsg (buf);
-        return tunnel_abort (t, "invalid backend: %s", "URL too big");
+static void
+proxy_manage_completion (proxy_t * p, int res, uint32_t flags)
+{
+    // The multishot accept stopped, because it has been cancelled or
+    // after an error. It is rearmed unless the proxy has been paused.
+    if (!(flags & IORING_CQE_F_MORE)) {
+        ASSERT (ISMONITORED (p));
+        --count_epoll;
+        p->flags &= ~FLAG_LISTED;
+        if (p->events) {
+            p->flags |= FLAG_ACTIVE;
+            PREPEND_STRUCT (ACTIVE_STRUCT_NAME (proxy_t), p);
+        }
     }
-    else {
-        char *sto = alloca (rc + 1);
 
-        memcpy (sto, buf, rc);
-        sto[rc] = 0;
-        rc = sockaddr_init (SA (&to), sto);
-        nn_freemsg (buf);
-        if (!rc)
-            return tunnel_abort (t, "invalid backend: %s", "bad URL");
-        char sfrom[64];
+    if (res >= 0) {
+        struct sockaddr_in6 from;
+        socklen_t slen = sizeof (from);
 
-        sockaddr_dump (SA (&from), sfrom, sizeof (sfrom));
-        ACCESS ("%llu %s -> %s", t->id, sfrom, sto);
+        if (0 > getpeername (res, SA (&from), &slen))
+            memset (&from, 0, sizeof (from));
+        proxy_accepted (p, res, &from);
+    }
+    else if (res != -ECANCELED) {
+        LOG ("accept() error : (%d) %s", -res, strerror (-res));
     }
+}
 
-    // Connect to the polled backend
-    t->back.sock =
-        socket (SAFAM (&to), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
-    if (t->back.sock < 0)
-        return tunnel_abort (t, "socket() error: (%d) %s",
-            errno, strerror (errno));
+/* -------------------------------------------------------------------------- */
 
-    slen = sizeof (struct sockaddr_in6);
-    rc = connect (t->back.sock, SA (&to), slen);
-    if (0 > rc && errno != EINPROGRESS)
-        return tunnel_abort (t, "connect() error: (%d) %s",
-            errno, strerror (errno));
+static void
+manage_completions (int to_max)
+{
+    struct io_uring_cqe *cqe;
+    int rc, to = 0;
 
-    // Tweak the socket options
-    if (opt_buffer_size) {
-        opt = PIPE_SIZE / 2;
-        setsockopt (t->front.sock, SOL_SOCKET, SO_RCVBUF, &opt, sizeof (opt));
-        setsockopt (t->back.sock, SOL_SOCKET, SO_RCVBUF, &opt, sizeof (opt));
-        opt = PIPE_SIZE;
-        setsockopt (t->front.sock, SOL_SOCKET, SO_SNDBUF, &opt, sizeof (opt));
-        setsockopt (t->back.sock, SOL_SOCKET, SO_SNDBUF, &opt, sizeof (opt));
+    if (count_epoll && !ACTIVE_STRUCT_NAME (proxy_t)
+        && !ACTIVE_STRUCT_NAME (channel_t))
+        to = to_max;
+    if (0 > (rc = uring_enter (&ring, to))) {
+        if (errno != EINTR && errno != ETIME && errno != EBUSY) {
+            LOG ("io_uring_enter() failed : (%d) %s", errno, strerror (errno));
+            exit (-1);
+        }
     }
 
-    if (opt_chatty_update) {
-        sock_set_chatty (t->front.sock, opt_chatty_front);
-        sock_set_chatty (t->back.sock, opt_chatty_back);
+    ++metrics->wakeups;
+    while (NULL != (cqe = uring_cqe (&ring))) {
+        uint64_t ud = cqe->user_data;
+        uint32_t flags = cqe->flags;
+        int res = cqe->res;
+
+        uring_cqe_seen (&ring);
+        ++metrics->events;
+        switch (UD_TAG (ud)) {
+            case UD_ACCEPT:
+                proxy_manage_completion (UD_PTR (ud), res, flags);
+                break;
+            case UD_FEED:
+                --count_epoll;
+                feed_manage_event (UD_PTR (ud));
+                break;
+            case UD_POLL:
+            case UD_CONNECT:
+                channel_manage_completion (UD_PTR (ud), UD_TAG (ud), res);
+                break;
+        }
     }
-
-    errno = 0;
-    tunnel_register (t);
 }
 
-/* -------------------------------------------------------------------------- */
-
 static void
-manage_monitored_items ()
+manage_monitored_items (int to_max)
 {
     struct epoll_event evt[MAXEVT];
     int rc, to = 0;
 
 retry:
     if (!ACTIVE_STRUCT_NAME (proxy_t) && !ACTIVE_STRUCT_NAME (channel_t))
-        to = -1;
+        to = to_max;
     if (0 > (rc = epoll_wait (fd_epoll, evt, MAXEVT, to))) {
         if (errno == EINTR) {
             if (!running)
@@ -797,12 +2877,23 @@ retry:
         return;
     }
 
-    ASSERT (count_epoll >= rc);
-    count_epoll -= rc;
+    ++metrics->wakeups;
+    metrics->events += rc;
     for (register int i = 0; i < rc; ++i) {
         struct monitored_s *mon = evt[i].data.ptr;
 
+        // Still registered, whatever the edge
+        if (opt_engine == ENGINE_EDGE && mon->type == CHANNEL) {
+            channel_edge ((channel_t *) mon, evt[i].events);
+            continue;
+        }
+        ASSERT (count_epoll > 0);
+        --count_epoll;
         ASSERT (ISMONITORED (mon));
+        if (mon->type == FEED) {
+            feed_manage_event ((feed_t *) mon);
+            continue;
+        }
         mon->events = evt[i].events;
         mon->flags = SETACT (mon->flags) & ~FLAG_ACTIVITY;
         if (mon->type == PROXY) {
@@ -814,14 +2905,98 @@ retry:
     }
 }
 
+// The slabs are private to the event loop. The tunnels and their pipes
+// are prefaulted, so that the first burst of clients does not stall in
+// page faults.
+static void
+main_init_slabs (void)
+{
+    int flags = (opt_slab_huge ? SLAB_HUGE : 0)
+        | (opt_slab_lock ? SLAB_LOCK : 0);
+    unsigned int high = opt_idle_high > 0 ? opt_idle_high : 0;
+    unsigned int low = opt_idle_low > 0 ? opt_idle_low : 0;
+
+    if (low > high)
+        low = high;
+    slab_init (&SLAB_STRUCT_NAME (tunnel_t), sizeof (tunnel_t), flags,
+        &metrics->slab, NULL);
+    slab_init (&SLAB_STRUCT_NAME (pipe_t), sizeof (pipe_t), flags,
+        &metrics->slab, pipe_fini);
+    slab_init (&SLAB_STRUCT_NAME (client_t), sizeof (client_t), flags,
+        &metrics->slab, NULL);
+    SLAB_STRUCT_NAME (tunnel_t).idle_high = high;
+    SLAB_STRUCT_NAME (tunnel_t).idle_low = low;
+    SLAB_STRUCT_NAME (pipe_t).idle_high = 2 * high;
+    SLAB_STRUCT_NAME (pipe_t).idle_low = 2 * low;
+    SLAB_STRUCT_NAME (client_t).idle_high = high;
+    SLAB_STRUCT_NAME (client_t).idle_low = low;
+    if (opt_prewarm > 0
+        && (!slab_reserve (&SLAB_STRUCT_NAME (tunnel_t), opt_prewarm)
+            || !slab_reserve (&SLAB_STRUCT_NAME (pipe_t), 2 * opt_prewarm)))
+        LOG ("prewarm(%d) failed : (%d) %s", opt_prewarm, errno,
+            strerror (errno));
+}
+
 static void
 main_loop (proxy_t * p, char **feeders)
 {
-    /* Called once per child, there is no need to inherit this from the
+    /* Called once per worker, there is no need to inherit this from the
      * father process, so we init this here. */
+    next_tunnel_id = ((uint64_t) main_worker_id) << 48;
+    metrics = metrics_shm ? metrics_shm->block + main_worker_id
+        : &metrics_local;
+    metrics->started = time (NULL);
+    metrics->pid = getpid ();
+    if (opt_access_ring > 0)
+        access_ring = access_open (opt_access_ring);
+    main_init_slabs ();
+    pipe_prewarm ();
+    now_us = main_now_us ();
+    now_ms = now_us / 1000;
+    wheel_init (&timers, now_ms);
+    // The global rate is shared evenly among the event loops
+    if (opt_rate_global > 0) {
+        global_rate = opt_rate_global / (main_workers ? main_workers : 1);
+        if (global_rate <= 0)
+            global_rate = 1;
+        bucket_init (&global_bucket, global_rate);
+    }
+    // And so is the memory budget
+    if (opt_mem_budget > 0) {
+        budget = (uint64_t) opt_mem_budget * 1024 * 1024
+            / (main_workers ? main_workers : 1);
+        if (budget_used () >= budget)
+            LOG ("mem_budget(%d MB) below the prewarmed memory",
+                opt_mem_budget);
+    }
+    // Without BPF, or its privileges, the tunnels are all spliced
+    if (opt_sockmap > 0) {
+        if (0 > sockmap_init (&sockmap, 2 * opt_sockmap))
+            LOG ("sockmap(%d) failed : (%d) %s", opt_sockmap, errno,
+                strerror (errno));
+        else
+            sockmap_ready = 1;
+    }
     proxy_init_feeders (p, feeders);
-    fd_epoll = epoll_create (8192);
-    ASSERT (fd_epoll >= 0);
+    // The pool leaves room for the holes of the connections taken
+    if (opt_warm > 0) {
+        size_t sz;
+
+        for (sz = 1; sz < 2 * (size_t) opt_warm; sz <<= 1);
+        p->warm.tab = calloc (sz, sizeof (struct warm_s));
+        p->warm.mask = sz - 1;
+        ASSERT (p->warm.tab != NULL);
+    }
+    if (opt_engine == ENGINE_URING) {
+        if (0 > uring_init (&ring, 4096)) {
+            LOG ("io_uring_setup() failed : (%d) %s", errno, strerror (errno));
+            exit (1);
+        }
+    }
+    else {
+        fd_epoll = epoll_create (8192);
+        ASSERT (fd_epoll >= 0);
+    }
 
     if (0 > listen (p->sock_front, front_backlog)) {
         LOG ("front(%d).listen(%d) failed", p->sock_front, front_backlog);
@@ -829,10 +3004,25 @@ main_loop (proxy_t * p, char **feeders)
     }
 
     proxy_register (p);
+    feed_register (&p->feed);
     while (running) {
         DEBUG ("--- monitoring loop");
-        if (count_epoll)
-            manage_monitored_items ();
+        if (opt_engine == ENGINE_URING)
+            manage_completions (proxy_timeout (p));
+        else if (count_epoll)
+            manage_monitored_items (proxy_timeout (p));
+
+        // One precise clock read per loop, the events it just polled are
+        // all stamped with it.
+        now_us = main_now_us ();
+        now_ms = now_us / 1000;
+        wheel_advance (&timers, now_ms, timer_expired);
+        proxy_manage_waiting (p);
+        if (opt_warm > 0)
+            proxy_warm (p);
+        // The pipes released meanwhile may leave room in the budget
+        if (budget && ISANY (p->flags, FLAG_PAUSED))
+            proxy_throttle (p);
 
         /* manage active channels */
         channel_t *chan, *chans = ACTIVE_STRUCT_NAME (channel_t);
@@ -841,7 +3031,10 @@ main_loop (proxy_t * p, char **feeders)
         while (chans != NULL) {
             SHIFT_STRUCT (chans, chan);
             chan->flags &= ~FLAG_LISTED;
-            channel_manage_events (chan, chan->events);
+            if (!chan->status)  // Released meanwhile
+                tunnel_recycle (chan->tunnel);
+            else
+                channel_manage_events (chan, chan->events);
         }
 
         /* manage active proxies */
@@ -858,32 +3051,177 @@ main_loop (proxy_t * p, char **feeders)
     }
 }
 
+static int
+proxy_option (const char *name, const char *value)
+{
+    for (struct option_s * o = options; o->name; ++o) {
+        if (strcmp (o->name, name))
+            continue;
+        if (o->text) {
+            *o->text = value;
+            return 1;
+        }
+        if (!o->choices) {
+            *o->value = atoi (value);
+            return 1;
+        }
+        for (int i = 0; o->choices[i]; ++i) {
+            if (!strcmp (o->choices[i], value)) {
+                *o->value = i;
+                return 1;
+            }
+        }
+        return 0;
+    }
+    return 0;
+}
+
+// The comma-separated list of -o sources, addresses without ports
+static void
+main_sources (const char *list)
+{
+    char buf[80];
+    const char *p, *end;
+
+    for (p = list; *p; p = *end ? end + 1 : end) {
+        if (!(end = strchr (p, ',')))
+            end = p + strlen (p);
+        sources = realloc (sources, (sources_count + 1) * sizeof (*sources));
+        ASSERT (sources != NULL);
+        snprintf (buf, sizeof (buf), "%.*s:0", (int) (end - p), p);
+        if (end - p >= (int) sizeof (buf) - 2
+            || !sockaddr_init (SA (sources + sources_count), buf)) {
+            LOG ("source(%.*s) invalid", (int) (end - p), p);
+            exit (1);
+        }
+        ++sources_count;
+    }
+}
+
+// The default size of the buffers in the sysctl <name>, the second of
+// its "min default max" values
+static int
+main_tcp_mem (const char *name, int dflt)
+{
+    char path[128];
+    int min, val, max;
+    FILE *f;
+
+    snprintf (path, sizeof (path), "/proc/sys/net/ipv4/%s", name);
+    if (!(f = fopen (path, "r")))
+        return dflt;
+    if (3 != fscanf (f, "%d %d %d", &min, &val, &max) || val <= 0)
+        val = dflt;
+    fclose (f);
+    return val;
+}
+
 int
 main (int argc, char **argv)
 {
     if (argc < 3) {
-        LOG ("%s FRONT FEED...", argv[0]);
+        LOG ("%s [-d] [-f|-t] [-w COUNT] [-o NAME=VALUE]... FRONT FEED...",
+            argv[0]);
         exit (1);
     }
 
+    main_option = proxy_option;
     char **opts = main_init (argc, argv);
-    proxy_t proxy;
+    struct sockaddr_in6 front;
 
-    proxy_init (&proxy);
-    proxy_init_front (&proxy, *opts);
+    if (!*opts || !opts[1]) {
+        LOG ("%s [-d] [-f|-t] [-w COUNT] [-o NAME=VALUE]... FRONT FEED...",
+            argv[0]);
+        exit (1);
+    }
+    if (!sockaddr_init (SA (&front), *opts)) {
+        LOG ("front(%s) invalid", *opts);
+        exit (1);
+    }
+    // A page at least, the kernel rounds the sizes up anyway
+    if (opt_pipe_min < 4096)
+        opt_pipe_min = 4096;
+    if (opt_pipe_max < opt_pipe_min)
+        opt_pipe_max = opt_pipe_min;
+    if (opt_buffer_lean < 4096)
+        opt_buffer_lean = 4096;
+    if (opt_copy_max > COPY_SIZE)
+        opt_copy_max = COPY_SIZE;
+    if (opt_feedback_period < 10)
+        opt_feedback_period = 10;
+    if (opt_sources)
+        main_sources (opt_sources);
+    sockbuf_rcv_default = main_tcp_mem ("tcp_rmem", sockbuf_rcv_default);
+    sockbuf_snd_default = main_tcp_mem ("tcp_wmem", sockbuf_snd_default);
+
+    // The segment is mapped before the workers are started, so that the
+    // forked ones share it as well.
+    char shm_name[128];
+    pid_t shm_owner = getpid ();
+
+    if (opt_access_ring > 0 && !access_init (opt_access_log)) {
+        LOG ("access(%s) failed : (%d) %s", opt_access_log, errno,
+            strerror (errno));
+        exit (1);
+    }
+    metrics_name (shm_name, sizeof (shm_name), *opts);
+    if (opt_metrics
+        && !(metrics_shm = metrics_map (shm_name, main_count_workers ())))
+        LOG ("metrics(%s) failed : (%d) %s", shm_name, errno,
+            strerror (errno));
 
     void _run ()
     {
+        proxy_t proxy;
+
+        proxy_init (&proxy);
+        proxy_init_front (&proxy, SA (&front), *opts);
         main_loop (&proxy, opts + 1);
+
+        while (proxy.waiting.head)
+            tunnel_release (proxy_undefer (&proxy));
+        LOG ("worker %u: %llu connects, %llu failovers", main_worker_id,
+            (unsigned long long) metrics->connects,
+            (unsigned long long) metrics->failovers);
+        if (proxy.feed.tokens.msg.buf)
+            nn_freemsg (proxy.feed.tokens.msg.buf);
+        nn_close (proxy.feed.nn);
+        if (proxy.feed.fb >= 0)
+            nn_close (proxy.feed.fb);
+        free (backends);
+        free (backends_spare);
+        backends = backends_spare = NULL;
+        free (proxy.feed.tokens.tab);
+        for (; proxy.warm.head != proxy.warm.tail; ++proxy.warm.head) {
+            struct warm_s *w = proxy.warm.tab
+                + (proxy.warm.head & proxy.warm.mask);
+
+            if (w->sock >= 0)
+                close (w->sock);
+        }
+        free (proxy.warm.tab);
+        close (proxy.sock_front);
+        if (opt_engine == ENGINE_URING)
+            uring_fini (&ring);
+        else
+            close (fd_epoll);
+        proxy.feed.nn = proxy.sock_front = fd_epoll = -1;
+        PURGE_STRUCT_CALL (tunnel_t);
+        PURGE_STRUCT_CALL (pipe_t);
+        PURGE_STRUCT_CALL (client_t);
+        access_close (access_ring);
+        access_ring = NULL;
+        if (sockmap_ready)
+            sockmap_fini (&sockmap);
+        sockmap_ready = 0;
     }
     main_run (&_run);
+    access_fini ();
 
-    nn_close (proxy.nn_feed);
-    close (proxy.sock_front);
-    close (fd_epoll);
-    proxy.nn_feed = proxy.sock_front = fd_epoll = -1;
-    PURGE_STRUCT_CALL (tunnel_t);
-    PURGE_STRUCT_CALL (pipe_t);
+    if (metrics_shm && getpid () == shm_owner) {
+        metrics_unmap (metrics_shm);
+        shm_unlink (shm_name);
+    }
     nn_term ();
     return 0;
 }
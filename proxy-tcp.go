@@ -5,6 +5,7 @@ import (
 	"github.com/gdamore/mangos/protocol/pull"
 	"github.com/gdamore/mangos/transport/ipc"
 	"github.com/gdamore/mangos/transport/tcp"
+	"encoding/binary"
 	"errors"
 	"flag"
 	"io"
@@ -14,8 +15,17 @@ import (
 	"sync"
 )
 
+// Binary form of the messages, see the TOKEN_* macros in utils.h
+const (
+	tokenMagic   = 0xFB
+	tokenVersion = 1
+	tokenHeader  = 4
+	tokenExt     = 0x10
+)
+
 var format string = "TCPURL,NNURL[,NNURL...]"
 var BadFront error = errors.New("Invalid front description, expecting " + format)
+var BadToken error = errors.New("Invalid token message")
 
 func main() {
 	flag.Parse()
@@ -71,6 +81,7 @@ type Front struct {
 	endpoint *net.TCPListener
 	feeder   mangos.Socket
 	tokens   chan bool
+	pending  []*net.TCPAddr
 }
 
 func MakeFront(server *Server, concurrency int, config string) (*Front, error) {
@@ -131,13 +142,66 @@ func (self *Front) produce() {
 	self.server.produce()
 }
 
+// Decode a message from the generator, in the legacy text form or in
+// the binary form carrying a batch of addresses. A binary message whose
+// records do not match the count of its header is rejected as a whole.
+func decodeTokens(msg []byte) ([]*net.TCPAddr, error) {
+	if len(msg) <= 0 || msg[0] != tokenMagic {
+		if addr, err := net.ResolveTCPAddr("tcp", string(msg)); err != nil {
+			return nil, err
+		} else {
+			return []*net.TCPAddr{addr}, nil
+		}
+	}
+	if len(msg) < tokenHeader || msg[1] != tokenVersion {
+		return nil, BadToken
+	}
+	count := int(binary.BigEndian.Uint16(msg[2:]))
+	out := make([]*net.TCPAddr, 0, count)
+	for b := msg[tokenHeader:]; len(b) > 0; {
+		if len(b) < 4 || len(out) >= count {
+			return nil, BadToken
+		}
+		alen := 4
+		if b[0]&0x0F == 6 {
+			alen = 16
+		} else if b[0]&0x0F != 4 {
+			return nil, BadToken
+		}
+		rlen := 4 + alen
+		if b[0]&tokenExt != 0 {
+			rlen += 6
+		}
+		if len(b) < rlen {
+			return nil, BadToken
+		}
+		ip := make(net.IP, alen)
+		copy(ip, b[4:4+alen])
+		port := int(binary.BigEndian.Uint16(b[2:]))
+		out = append(out, &net.TCPAddr{IP: ip, Port: port})
+		b = b[rlen:]
+	}
+	if len(out) != count {
+		return nil, BadToken
+	}
+	return out, nil
+}
+
 func (self *Front) poll() (*net.TCPAddr, error) {
-	if burl, err := self.feeder.Recv(); err != nil {
-		log.Println("No URL available:", err)
-		return nil, err
-	} else {
-		return net.ResolveTCPAddr("tcp", string(burl))
+	for len(self.pending) <= 0 {
+		if msg, err := self.feeder.Recv(); err != nil {
+			log.Println("No URL available:", err)
+			return nil, err
+		} else if addrs, err := decodeTokens(msg); err != nil {
+			log.Println("Invalid backend:", err, "in a", len(msg), "bytes message")
+			return nil, err
+		} else {
+			self.pending = addrs
+		}
 	}
+	addr := self.pending[0]
+	self.pending = self.pending[1:]
+	return addr, nil
 }
 
 func (self *Front) run() {
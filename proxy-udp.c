@@ -0,0 +1,898 @@
+#include <fcntl.h>
+#include <stddef.h>
+
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+
+#include <nanomsg/nn.h>
+#include <nanomsg/pipeline.h>
+
+#include "./utils.h"
+#include "./wheel.h"
+#include "./slab.h"
+
+// Missing from the older libc headers, the kernel has them since 5.0
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define FLAG_MONITORED    0x0004
+#define FLAG_ACTIVE       0x0008
+#define FLAG_LISTED       (FLAG_MONITORED|FLAG_ACTIVE)
+#define FLAG_REGISTERED   0x0040
+
+#define SETONE(F,S,O) (((F)&(~(S)))|(O))
+#define SETLIST(F,L)  SETONE(F,FLAG_LISTED,L)
+#define SETACT(F)     SETLIST(F,FLAG_ACTIVE)
+
+#define ISANY(F,O)    ((F)&(O))
+#define ISALL(F,O)    (ISANY(F,O)==(O))
+
+#define ISLISTED(i)     ISANY((i)->flags,FLAG_LISTED)
+#define ISACTIVE(i)     ISALL((i)->flags,FLAG_ACTIVE)
+#define ISMONITORED(i)  ISALL((i)->flags,FLAG_MONITORED)
+#define ISREGISTERED(i) ISALL((i)->flags,FLAG_REGISTERED)
+
+// With GRO, a single read may carry several datagrams of the same source,
+// up to the maximum size of an IP packet.
+#define MAXDGRAM  65536
+#define MAXBATCH  1024
+
+typedef struct feed_s feed_t;
+typedef struct proxy_s proxy_t;
+typedef struct flow_s flow_t;
+
+enum item_type_e
+{ PROXY = 1, FLOW, FEED };
+
+#define MONITORED_FIELDS \
+    void *next; \
+    uint32_t flags; \
+    uint32_t events; \
+    enum item_type_e type
+
+struct monitored_s
+{
+    MONITORED_FIELDS;
+};
+
+// Same prefetched ring of backends as in proxy-tcp-splice, a backend is
+// only popped for the first datagram of a flow.
+struct feed_s
+{
+    MONITORED_FIELDS;
+    int nn;
+    int fd;
+    struct token_ring_s tokens;
+};
+
+struct proxy_s
+{
+    MONITORED_FIELDS;
+    struct
+    {
+        unsigned int count;
+        unsigned int max;
+    } flows;
+    int sock_front;
+    feed_t feed;
+};
+
+// A flow is identified by the address of its client, and owns a socket
+// connected to its backend, so that the replies are routed back without
+// any lookup.
+struct flow_s
+{
+    MONITORED_FIELDS;
+    flow_t *hnext;              // hash chain
+    unsigned int slot;          // in flows[]
+    int sock;
+    uint64_t touched;           // last datagram, in either direction
+    struct wheel_timer_s timer; // at the idle deadline
+    struct sockaddr_in6 from, to;
+};
+
+// A batch of datagrams for recvmmsg() and sendmmsg(), with one buffer, one
+// address and one control message per datagram.
+struct batch_s
+{
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    struct sockaddr_in6 *names;
+    uint8_t *ctl;
+    uint8_t *buf;
+};
+
+#define CTL_SIZE CMSG_SPACE(sizeof(int))
+
+// All the runtime state below is private to an event loop
+static __thread flow_t *IDLE_STRUCT_NAME (flow_t) = NULL;
+static __thread struct slab_s SLAB_STRUCT_NAME (flow_t);
+static __thread struct slab_stats_s slab_stats;
+static __thread flow_t *ACTIVE_STRUCT_NAME (flow_t) = NULL;
+static __thread proxy_t *ACTIVE_STRUCT_NAME (proxy_t) = NULL;
+
+static __thread flow_t **flows = NULL;
+static __thread unsigned int flows_mask = 0;
+static __thread struct batch_s batch;
+static __thread int fd_epoll = -1;
+static __thread int count_epoll = 0;
+static __thread struct wheel_s timers;
+static __thread uint64_t now_ms = 0;    // refreshed once per loop
+
+static int opt_tokens = 256;
+static int opt_flows = 65536;
+static int opt_idle_timeout = 30000;
+static int opt_batch = 64;
+static int opt_gro = 1;
+static int opt_rcvbuf = 4194304;
+
+// The options that can be set with "-o NAME=VALUE"
+static struct option_s
+{
+    const char *name;
+    int *value;
+} options[] = {
+    {"tokens", &opt_tokens},
+    {"flows", &opt_flows},
+    {"idle_timeout", &opt_idle_timeout},
+    {"batch", &opt_batch},
+    {"gro", &opt_gro},
+    {"rcvbuf", &opt_rcvbuf},
+    {NULL, NULL}
+};
+
+static __thread struct
+{
+    uint64_t flows;
+    uint64_t datagrams;
+    uint64_t drops;
+} counters;
+
+/* -------------------------------------------------------------------------- */
+
+ACQUIRE_STRUCT_DECL (flow_t);
+RELEASE_STRUCT_DECL (flow_t);
+PURGE_STRUCT_DECL (flow_t);
+
+static void feed_register (feed_t * f);
+
+/* -------------------------------------------------------------------------- */
+
+static void
+batch_init (struct batch_s *b, unsigned int count)
+{
+    b->msgs = calloc (count, sizeof (struct mmsghdr));
+    b->iov = calloc (count, sizeof (struct iovec));
+    b->names = calloc (count, sizeof (struct sockaddr_in6));
+    b->ctl = calloc (count, CTL_SIZE);
+    b->buf = malloc ((size_t) count * MAXDGRAM);
+    if (!b->msgs || !b->iov || !b->names || !b->ctl || !b->buf)
+        abort ();
+}
+
+static void
+batch_fini (struct batch_s *b)
+{
+    free (b->msgs);
+    free (b->iov);
+    free (b->names);
+    free (b->ctl);
+    free (b->buf);
+    memset (b, 0, sizeof (*b));
+}
+
+// Reset the headers of the <count> first slots before a recvmmsg()
+static void
+batch_prepare_recv (struct batch_s *b, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; ++i) {
+        struct msghdr *m = &b->msgs[i].msg_hdr;
+
+        b->iov[i].iov_base = b->buf + (size_t) i * MAXDGRAM;
+        b->iov[i].iov_len = MAXDGRAM;
+        m->msg_iov = b->iov + i;
+        m->msg_iovlen = 1;
+        m->msg_name = b->names + i;
+        m->msg_namelen = sizeof (struct sockaddr_in6);
+        m->msg_control = b->ctl + i * CTL_SIZE;
+        m->msg_controllen = CTL_SIZE;
+        m->msg_flags = 0;
+    }
+}
+
+// Size of the segments coalesced by GRO in the slot <i>, 0 if none
+static int
+batch_segment (struct batch_s *b, unsigned int i)
+{
+    struct msghdr *m = &b->msgs[i].msg_hdr;
+
+    for (struct cmsghdr * c = CMSG_FIRSTHDR (m); c; c = CMSG_NXTHDR (m, c)) {
+        if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+            int seg;
+
+            memcpy (&seg, CMSG_DATA (c), sizeof (seg));
+            return seg;
+        }
+    }
+    return 0;
+}
+
+// Turn the slot <i> just received into a datagram to be sent to <to>, or
+// on a connected socket if NULL. The segments coalesced by GRO are sent
+// as a single buffer, split again by the kernel (GSO).
+static void
+batch_prepare_send (struct batch_s *b, unsigned int i, struct sockaddr_in6 *to)
+{
+    struct msghdr *m = &b->msgs[i].msg_hdr;
+    int seg = batch_segment (b, i);
+
+    b->iov[i].iov_len = b->msgs[i].msg_len;
+    m->msg_name = to;
+    m->msg_namelen = to ? SALEN (to) : 0;
+    if (seg <= 0 || (unsigned int) seg >= b->msgs[i].msg_len) {
+        m->msg_control = NULL;
+        m->msg_controllen = 0;
+    }
+    else {
+        uint16_t seg16 = seg;
+        struct cmsghdr *c;
+
+        m->msg_control = b->ctl + i * CTL_SIZE;
+        m->msg_controllen = CMSG_SPACE (sizeof (seg16));
+        c = CMSG_FIRSTHDR (m);
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN (sizeof (seg16));
+        memcpy (CMSG_DATA (c), &seg16, sizeof (seg16));
+    }
+    m->msg_flags = 0;
+}
+
+// The device may refuse the segmentation offload (EIO), then the segments
+// are sent one by one.
+static void
+batch_send_split (int fd, struct msghdr *m)
+{
+    struct cmsghdr *c = CMSG_FIRSTHDR (m);
+    uint8_t *p = m->msg_iov->iov_base;
+    size_t len = m->msg_iov->iov_len;
+    uint16_t seg;
+
+    memcpy (&seg, CMSG_DATA (c), sizeof (seg));
+    for (size_t off = 0; off < len; off += seg) {
+        size_t l = (len - off < seg) ? len - off : seg;
+
+        if (0 > sendto (fd, p + off, l, MSG_DONTWAIT, m->msg_name,
+                m->msg_namelen))
+            ++counters.drops;
+    }
+}
+
+// Send the slots [first,first+count[ prepared with batch_prepare_send().
+// UDP gives no guaranty, a datagram that cannot be sent now is dropped.
+static void
+batch_send (int fd, unsigned int first, unsigned int count)
+{
+    struct mmsghdr *msgs = batch.msgs + first;
+
+    while (count > 0) {
+        int rc = sendmmsg (fd, msgs, count, MSG_DONTWAIT);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                counters.drops += count;
+                return;
+            }
+            // Only the first datagram failed
+            if (errno == EIO && msgs->msg_hdr.msg_controllen)
+                batch_send_split (fd, &msgs->msg_hdr);
+            else
+                ++counters.drops;
+            rc = 1;
+        }
+        msgs += rc;
+        count -= rc;
+    }
+}
+
+// Best effort, the datagrams are just not coalesced without GRO
+static void
+sock_set_gro (int fd)
+{
+    int opt = 1;
+
+    if (opt_gro)
+        setsockopt (fd, SOL_UDP, UDP_GRO, &opt, sizeof (opt));
+}
+
+/* -------------------------------------------------------------------------- */
+
+#define FEED_COUNT(f) TOKEN_RING_COUNT (&(f)->tokens)
+#define FEED_SIZE(f)  TOKEN_RING_SIZE (&(f)->tokens)
+
+static void
+feed_register (feed_t * f)
+{
+    int op = ISREGISTERED (f) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    struct epoll_event evt;
+
+    evt.data.ptr = f;
+    evt.events = EPOLLET | EPOLLONESHOT | EPOLLIN;
+    int rc = epoll_ctl (fd_epoll, op, f->fd, &evt);
+
+    ASSERT (rc == 0);
+    (void) rc;
+    ++count_epoll;
+    f->flags |= FLAG_REGISTERED | FLAG_MONITORED;
+}
+
+// Drain the nanomsg socket until the ring is full. The feed is monitored
+// again only if there is room left, otherwise feed_pop() will do it.
+static void
+feed_refill (feed_t * f)
+{
+    while (FEED_COUNT (f) < FEED_SIZE (f)) {
+        if (!f->tokens.msg.buf) {
+            int rc = nn_recv (f->nn, &f->tokens.msg.buf, NN_MSG, NN_DONTWAIT);
+
+            if (rc < 0) {
+                f->tokens.msg.buf = NULL;
+                break;
+            }
+            f->tokens.msg.len = rc;
+            f->tokens.msg.off = 0;
+        }
+        if (!token_ring_fill (&f->tokens)) {
+            nn_freemsg (f->tokens.msg.buf);
+            f->tokens.msg.buf = NULL;
+        }
+    }
+
+    if (FEED_COUNT (f) < FEED_SIZE (f))
+        feed_register (f);
+}
+
+static void
+feed_manage_event (feed_t * f)
+{
+    ASSERT (ISMONITORED (f));
+    f->flags &= ~FLAG_LISTED;
+    feed_refill (f);
+}
+
+// Return FALSE if no backend is available yet
+static int
+feed_pop (feed_t * f, struct sockaddr_in6 *to)
+{
+    if (!token_ring_pop (&f->tokens, to))
+        return 0;
+    if (!ISMONITORED (f) && FEED_COUNT (f) <= FEED_SIZE (f) / 2)
+        feed_register (f);
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+// Only the address and the port identify a client, the flow label of an
+// IPv6 client may vary between its datagrams.
+static unsigned int
+flow_hash (const struct sockaddr_in6 *sa)
+{
+    const uint8_t *b = SABUF (sa);
+    size_t len = (SAFAM (sa) == AF_INET) ? 4 : 16;
+    uint16_t port = SAPRT (sa);
+    unsigned int h = 2166136261u;
+
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ b[i]) * 16777619u;
+    h = (h ^ (port & 0xFF)) * 16777619u;
+    h = (h ^ (port >> 8)) * 16777619u;
+    return h & flows_mask;
+}
+
+static int
+flow_match (const flow_t * f, const struct sockaddr_in6 *sa)
+{
+    if (SAFAM (&f->from) != SAFAM (sa) || SAPRT (&f->from) != SAPRT (sa))
+        return 0;
+    return !memcmp (SABUF (&f->from), SABUF (sa),
+        (SAFAM (sa) == AF_INET) ? 4 : 16);
+}
+
+static flow_t *
+flow_lookup (const struct sockaddr_in6 *sa)
+{
+    for (flow_t * f = flows[flow_hash (sa)]; f; f = f->hnext) {
+        if (flow_match (f, sa))
+            return f;
+    }
+    return NULL;
+}
+
+static void
+flow_register (flow_t * f)
+{
+    int op = ISREGISTERED (f) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    struct epoll_event evt;
+
+    evt.data.ptr = f;
+    evt.events = EPOLLET | EPOLLONESHOT | EPOLLIN;
+    int rc = epoll_ctl (fd_epoll, op, f->sock, &evt);
+
+    ASSERT (rc == 0);
+    (void) rc;
+    ++count_epoll;
+    f->flags = SETLIST (f->flags, FLAG_MONITORED) | FLAG_REGISTERED;
+}
+
+// The timer is only moved when it expires, the activity of the flow
+// just updates <touched>.
+static void
+flow_arm (flow_t * f)
+{
+    wheel_add (&timers, &f->timer, f->touched + opt_idle_timeout);
+}
+
+// Open a flow for the new client <from>, on the next backend of the feed.
+// Returns NULL when the flow cannot be opened, then its datagram is
+// dropped and the next one will try again.
+static flow_t *
+flow_open (proxy_t * p, const struct sockaddr_in6 *from)
+{
+    struct sockaddr_in6 to;
+    flow_t *f;
+    int sock;
+
+    if (p->flows.count >= p->flows.max || !feed_pop (&p->feed, &to))
+        return NULL;
+
+    sock = socket (SAFAM (&to), SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return NULL;
+    if (0 > connect (sock, SA (&to), SALEN (&to))) {
+        char sto[64];
+
+        sockaddr_dump (SA (&to), sto, sizeof (sto));
+        LOG ("back(%s).connect() failed : (%d) %s", sto, errno,
+            strerror (errno));
+        close (sock);
+        return NULL;
+    }
+    sock_set_gro (sock);
+
+    f = ACQUIRE_STRUCT_CALL (flow_t);
+    f->flags = 0;
+    f->events = 0;
+    f->type = FLOW;
+    f->sock = sock;
+    f->from = *from;
+    f->to = to;
+    f->touched = now_ms;
+    f->timer.next = f->timer.prev = NULL;
+    f->slot = flow_hash (from);
+    f->hnext = flows[f->slot];
+    flows[f->slot] = f;
+    ++p->flows.count;
+    ++counters.flows;
+
+    flow_register (f);
+    flow_arm (f);
+
+#ifdef HAVE_DEBUG
+    char sfrom[64], sto[64];
+
+    sockaddr_dump (SA (from), sfrom, sizeof (sfrom));
+    sockaddr_dump (SA (&to), sto, sizeof (sto));
+    DEBUG ("flow(%d) %s -> %s", sock, sfrom, sto);
+#endif
+    return f;
+}
+
+// Closing the socket removes it from the epoll, a flow being closed is
+// never on the ACTIVE list.
+static void
+flow_close (proxy_t * p, flow_t * f)
+{
+    flow_t **pf;
+
+    ASSERT (!ISACTIVE (f));
+    if (ISMONITORED (f))
+        --count_epoll;
+    wheel_del (&timers, &f->timer);
+    close (f->sock);
+    f->sock = -1;
+    for (pf = flows + f->slot; *pf != f; pf = &(*pf)->hnext);
+    *pf = f->hnext;
+    f->hnext = NULL;
+    f->flags = 0;
+    --p->flows.count;
+    RELEASE_STRUCT_CALL (flow_t, f);
+}
+
+// Forward the replies of the backend to the client, a batch at a time.
+// The flow remains ACTIVE while it has a full batch to read.
+static void
+flow_manage_event (proxy_t * p, flow_t * f)
+{
+    int rc;
+
+    batch_prepare_recv (&batch, opt_batch);
+    for (int i = 0; i < opt_batch; ++i)
+        batch.msgs[i].msg_hdr.msg_name = NULL;
+retry:
+    rc = recvmmsg (f->sock, batch.msgs, opt_batch, MSG_DONTWAIT, NULL);
+    if (rc < 0) {
+        if (errno == EINTR)
+            goto retry;
+        if (errno == EAGAIN)
+            return flow_register (f);
+        // Most likely ECONNREFUSED: the next datagram of the client
+        // will open a new flow to another backend.
+        DEBUG ("flow(%d) error : (%d) %s", f->sock, errno, strerror (errno));
+        return flow_close (p, f);
+    }
+
+    f->touched = now_ms;
+    counters.datagrams += rc;
+    for (int i = 0; i < rc; ++i)
+        batch_prepare_send (&batch, i, &f->from);
+    batch_send (p->sock_front, 0, rc);
+
+    if (rc < opt_batch)
+        return flow_register (f);
+    f->flags = SETACT (f->flags);
+    PREPEND_STRUCT (ACTIVE_STRUCT_NAME (flow_t), f);
+}
+
+static void
+flow_expired (proxy_t * p, flow_t * f)
+{
+    if (ISACTIVE (f) || now_ms < f->touched + opt_idle_timeout) {
+        if (ISACTIVE (f))
+            f->touched = now_ms;
+        return flow_arm (f);
+    }
+    DEBUG ("flow(%d) idle", f->sock);
+    flow_close (p, f);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+proxy_register (proxy_t * p)
+{
+    int op = ISREGISTERED (p) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    struct epoll_event evt;
+
+    evt.data.ptr = p;
+    evt.events = EPOLLET | EPOLLONESHOT | EPOLLIN;
+    int rc = epoll_ctl (fd_epoll, op, p->sock_front, &evt);
+
+    ASSERT (rc == 0);
+    (void) rc;
+    ++count_epoll;
+    p->flags = SETLIST (p->flags, FLAG_MONITORED) | FLAG_REGISTERED;
+}
+
+static void
+proxy_init (proxy_t * p)
+{
+    struct rlimit rl;
+
+    memset (p, 0, sizeof (*p));
+    p->type = PROXY;
+    p->sock_front = -1;
+    p->feed.type = FEED;
+    p->feed.nn = p->feed.fd = -1;
+
+    if (0 != getrlimit (RLIMIT_NOFILE, &rl))
+        abort ();
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit (RLIMIT_NOFILE, &rl);
+    // One descriptor per flow, and the threads share the same table
+    p->flows.max = rl.rlim_max - 64;
+    if (main_flags & MF_THREADS)
+        p->flows.max /= main_workers;
+    if (opt_flows > 0 && p->flows.max > (unsigned int) opt_flows)
+        p->flows.max = opt_flows;
+    LOG ("p.max = %u", p->flows.max);
+}
+
+// Each worker binds its own socket on the same address, and the kernel
+// balances the clients among them.
+static void
+proxy_init_front (proxy_t * p, const struct sockaddr *ss, const char *front)
+{
+    int opt = 1;
+
+    p->sock_front = socket (SAFAM (ss), SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    ASSERT (p->sock_front >= 0);
+
+    setsockopt (p->sock_front, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof (opt));
+    setsockopt (p->sock_front, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof (opt));
+    // Absorb the bursts of all the clients, capped by net.core.rmem_max
+    if (opt_rcvbuf > 0)
+        setsockopt (p->sock_front, SOL_SOCKET, SO_RCVBUF, &opt_rcvbuf,
+            sizeof (opt_rcvbuf));
+    sock_set_gro (p->sock_front);
+
+    if (0 > bind (p->sock_front, SA (ss), SALEN (ss))) {
+        LOG ("front(%d).bind(%s) failed", p->sock_front, front);
+        exit (1);
+    }
+
+    LOG ("front(%s) ready", front);
+}
+
+static void
+proxy_init_feeders (proxy_t * p, char **feeds)
+{
+    feed_t *f = &p->feed;
+    size_t sz;
+    int opt;
+
+    if (0 > (f->nn = nn_socket (AF_SP, NN_PULL))) {
+        LOG ("feeder.socket() failed");
+        exit (2);
+    }
+
+    opt = 32768;
+    nn_setsockopt (f->nn, NN_SOL_SOCKET, NN_RCVBUF, &opt, sizeof (opt));
+    opt = 1000;
+    nn_setsockopt (f->nn, NN_SOL_SOCKET, NN_RECONNECT_IVL, &opt,
+        sizeof (opt));
+    opt = 1000;
+    nn_setsockopt (f->nn, NN_SOL_SOCKET, NN_RECONNECT_IVL_MAX, &opt,
+        sizeof (opt));
+
+    sz = sizeof (f->fd);
+    if (0 > nn_getsockopt (f->nn, NN_SOL_SOCKET, NN_RCVFD, &f->fd, &sz)) {
+        LOG ("feeder.getsockopt(RCVFD) failed");
+        exit (2);
+    }
+
+    if (!token_ring_init (&f->tokens, opt_tokens)) {
+        LOG ("tokens(%d) failed", opt_tokens);
+        exit (2);
+    }
+
+    for (char **purl = feeds; *purl; ++purl) {
+        if (0 > nn_connect (f->nn, *purl)) {
+            LOG ("feeder.connect(%s) failed", *purl);
+            exit (2);
+        }
+        else {
+            LOG ("feeder.connect(%s)", *purl);
+        }
+    }
+}
+
+// Forward the datagrams of the clients to their backends, a batch at a
+// time. The consecutive datagrams of a flow are sent with a single call.
+static void
+proxy_manage_event (proxy_t * p)
+{
+    flow_t *dst[MAXBATCH];
+    int rc;
+
+    batch_prepare_recv (&batch, opt_batch);
+retry:
+    rc = recvmmsg (p->sock_front, batch.msgs, opt_batch, MSG_DONTWAIT, NULL);
+    if (rc < 0) {
+        if (errno == EINTR)
+            goto retry;
+        if (errno != EAGAIN)
+            LOG ("front.recvmmsg() failed : (%d) %s", errno, strerror (errno));
+        return proxy_register (p);
+    }
+
+    counters.datagrams += rc;
+    for (int i = 0; i < rc; ++i) {
+        if (!(dst[i] = flow_lookup (batch.names + i)))
+            dst[i] = flow_open (p, batch.names + i);
+        if (dst[i]) {
+            dst[i]->touched = now_ms;
+            batch_prepare_send (&batch, i, NULL);
+        }
+    }
+    for (int i = 0, j; i < rc; i = j) {
+        for (j = i + 1; j < rc && dst[j] == dst[i]; ++j);
+        if (dst[i])
+            batch_send (dst[i]->sock, i, j - i);
+        else
+            counters.drops += j - i;
+    }
+
+    if (rc < opt_batch)
+        return proxy_register (p);
+    p->flags = SETACT (p->flags);
+    PREPEND_STRUCT (ACTIVE_STRUCT_NAME (proxy_t), p);
+}
+
+/* -------------------------------------------------------------------------- */
+
+static void
+manage_monitored_items (int to_max)
+{
+    struct epoll_event evt[MAXEVT];
+    int rc, to = 0;
+
+retry:
+    if (!ACTIVE_STRUCT_NAME (proxy_t) && !ACTIVE_STRUCT_NAME (flow_t))
+        to = to_max;
+    if (0 > (rc = epoll_wait (fd_epoll, evt, MAXEVT, to))) {
+        if (errno == EINTR) {
+            if (!running)
+                return;
+            goto retry;
+        }
+        LOG ("epoll_wait() failed : (%d) %s", errno, strerror (errno));
+        exit (-1);
+        return;
+    }
+
+    ASSERT (count_epoll >= rc);
+    count_epoll -= rc;
+    for (register int i = 0; i < rc; ++i) {
+        struct monitored_s *mon = evt[i].data.ptr;
+
+        ASSERT (ISMONITORED (mon));
+        if (mon->type == FEED) {
+            feed_manage_event ((feed_t *) mon);
+            continue;
+        }
+        mon->events = evt[i].events;
+        mon->flags = SETACT (mon->flags);
+        if (mon->type == PROXY)
+            PREPEND_STRUCT (ACTIVE_STRUCT_NAME (proxy_t), (proxy_t *) mon);
+        else
+            PREPEND_STRUCT (ACTIVE_STRUCT_NAME (flow_t), (flow_t *) mon);
+    }
+}
+
+static void
+main_loop (proxy_t * p, char **feeders)
+{
+    void timer_expired (struct wheel_timer_s *tm)
+    {
+        flow_expired (p, (flow_t *) ((char *) tm - offsetof (flow_t, timer)));
+    }
+
+    flow_t *f, *fl;
+    unsigned int sz;
+
+    for (sz = 1; sz < p->flows.max; sz <<= 1);
+    flows = calloc (sz, sizeof (flow_t *));
+    flows_mask = sz - 1;
+    ASSERT (flows != NULL);
+    batch_init (&batch, opt_batch);
+    // The flows are already bounded, a quarter of them is kept idle
+    slab_init (&SLAB_STRUCT_NAME (flow_t), sizeof (flow_t), 0, &slab_stats,
+        NULL);
+    SLAB_STRUCT_NAME (flow_t).idle_high = p->flows.max;
+    SLAB_STRUCT_NAME (flow_t).idle_low = p->flows.max / 4;
+
+    now_ms = main_now ();
+    wheel_init (&timers, now_ms);
+    proxy_init_feeders (p, feeders);
+    fd_epoll = epoll_create (8192);
+    ASSERT (fd_epoll >= 0);
+
+    proxy_register (p);
+    feed_register (&p->feed);
+    while (running) {
+        DEBUG ("--- monitoring loop");
+        manage_monitored_items (wheel_timeout (&timers));
+
+        now_ms = main_now ();
+
+        /* manage active proxies first, it may open flows */
+        proxy_t *proxy, *proxies = ACTIVE_STRUCT_NAME (proxy_t);
+
+        ACTIVE_STRUCT_NAME (proxy_t) = NULL;
+        while (proxies != NULL) {
+            SHIFT_STRUCT (proxies, proxy);
+            proxy->flags &= ~FLAG_LISTED;
+            proxy_manage_event (proxy);
+        }
+
+        /* manage active flows */
+        fl = ACTIVE_STRUCT_NAME (flow_t);
+        ACTIVE_STRUCT_NAME (flow_t) = NULL;
+        while (fl != NULL) {
+            SHIFT_STRUCT (fl, f);
+            f->flags &= ~FLAG_LISTED;
+            flow_manage_event (p, f);
+        }
+
+        wheel_advance (&timers, now_ms, timer_expired);
+    }
+
+    // The flows still ACTIVE are detached from their list first
+    while (NULL != (f = ACTIVE_STRUCT_NAME (flow_t))) {
+        SHIFT_STRUCT (ACTIVE_STRUCT_NAME (flow_t), f);
+        f->flags &= ~FLAG_LISTED;
+    }
+    for (sz = 0; sz <= flows_mask; ++sz) {
+        while (flows[sz])
+            flow_close (p, flows[sz]);
+    }
+    free (flows);
+    flows = NULL;
+    batch_fini (&batch);
+}
+
+static int
+proxy_option (const char *name, const char *value)
+{
+    for (struct option_s * o = options; o->name; ++o) {
+        if (!strcmp (o->name, name)) {
+            *o->value = atoi (value);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    if (argc < 3) {
+        LOG ("%s [-d] [-f|-t] [-w COUNT] [-o NAME=VALUE]... FRONT FEED...",
+            argv[0]);
+        exit (1);
+    }
+
+    main_option = proxy_option;
+    char **opts = main_init (argc, argv);
+    struct sockaddr_in6 front;
+
+    if (!*opts || !opts[1]) {
+        LOG ("%s [-d] [-f|-t] [-w COUNT] [-o NAME=VALUE]... FRONT FEED...",
+            argv[0]);
+        exit (1);
+    }
+    if (!sockaddr_init (SA (&front), *opts)) {
+        LOG ("front(%s) invalid", *opts);
+        exit (1);
+    }
+    if (opt_batch <= 0 || opt_batch > MAXBATCH)
+        opt_batch = (opt_batch <= 0) ? 1 : MAXBATCH;
+
+    void _run ()
+    {
+        proxy_t proxy;
+
+        proxy_init (&proxy);
+        proxy_init_front (&proxy, SA (&front), *opts);
+        main_loop (&proxy, opts + 1);
+
+        LOG ("worker %u: %llu flows, %llu datagrams, %llu drops",
+            main_worker_id, (unsigned long long) counters.flows,
+            (unsigned long long) counters.datagrams,
+            (unsigned long long) counters.drops);
+        if (proxy.feed.tokens.msg.buf)
+            nn_freemsg (proxy.feed.tokens.msg.buf);
+        nn_close (proxy.feed.nn);
+        free (proxy.feed.tokens.tab);
+        close (proxy.sock_front);
+        close (fd_epoll);
+        proxy.feed.nn = proxy.sock_front = fd_epoll = -1;
+        PURGE_STRUCT_CALL (flow_t);
+    }
+    main_run (&_run);
+
+    nn_term ();
+    return 0;
+}
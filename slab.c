@@ -0,0 +1,199 @@
+#include <sys/mman.h>
+
+#include "./utils.h"
+#include "./slab.h"
+
+// Header of an arena, in its first cache lines. The objects never
+// allocated are carved on demand past <fresh>, so that the pages of an
+// arena are only touched when needed, unless the arena is prefaulted.
+struct slab_arena_s
+{
+    struct slab_arena_s *next, *prev;   // in <partial> or <full>
+    void *free;                 // linked through their first word
+    char *fresh;
+    unsigned int used;
+};
+
+#define ALIGNED(n)  (((n) + SLAB_ALIGN - 1) & ~((size_t) SLAB_ALIGN - 1))
+#define HEADER      ALIGNED (sizeof (struct slab_arena_s))
+#define ARENA(s,p)  ((struct slab_arena_s *) \
+        ((uintptr_t) (p) & ~((uintptr_t) (s)->arena_size - 1)))
+
+void
+slab_init (struct slab_s *s, size_t size, int flags,
+    struct slab_stats_s *stats, void (*fini) (void *p))
+{
+    size_t page = sysconf (_SC_PAGESIZE);
+
+    memset (s, 0, sizeof (*s));
+    s->size = ALIGNED (size);
+    s->flags = flags;
+    s->stats = stats;
+    s->fini = fini;
+    if (flags & SLAB_HUGE)
+        s->arena_size = SLAB_HUGEPAGE;
+    else
+        s->arena_size = page;
+    while (s->arena_size < HEADER + SLAB_OBJECTS * s->size)
+        s->arena_size <<= 1;
+    s->per_arena = (s->arena_size - HEADER) / s->size;
+}
+
+static void
+_list (struct slab_arena_s **head, struct slab_arena_s *a)
+{
+    a->prev = NULL;
+    if ((a->next = *head) != NULL)
+        a->next->prev = a;
+    *head = a;
+}
+
+static void
+_unlist (struct slab_arena_s **head, struct slab_arena_s *a)
+{
+    if (a->prev)
+        a->prev->next = a->next;
+    else
+        *head = a->next;
+    if (a->next)
+        a->next->prev = a->prev;
+    a->next = a->prev = NULL;
+}
+
+// Map an arena aligned on its size: MAP_HUGETLB mappings already are,
+// otherwise twice the size is mapped and trimmed around an aligned one.
+static struct slab_arena_s *
+_arena_map (struct slab_s *s, int prefault)
+{
+    const size_t len = s->arena_size;
+    const int prot = PROT_READ | PROT_WRITE;
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    char *base = MAP_FAILED;
+
+    if (s->flags & SLAB_HUGE) {
+        base = mmap (NULL, len, prot, flags | MAP_HUGETLB
+            | (prefault ? MAP_POPULATE : 0), -1, 0);
+        if (base == MAP_FAILED)
+            ++s->stats->huge_fallbacks;
+    }
+    if (base == MAP_FAILED) {
+        char *raw = mmap (NULL, 2 * len, prot, flags, -1, 0);
+
+        if (raw == MAP_FAILED)
+            return NULL;
+        base = (char *) (((uintptr_t) raw + len - 1) & ~(uintptr_t) (len - 1));
+        if (base > raw)
+            munmap (raw, base - raw);
+        if (raw + 2 * len > base + len)
+            munmap (base + len, raw + 2 * len - (base + len));
+        if (s->flags & SLAB_HUGE)
+            madvise (base, len, MADV_HUGEPAGE);
+        if (prefault)
+            memset (base, 0, len);
+    }
+    // Beyond RLIMIT_MEMLOCK, the next arenas are not even tried
+    if ((s->flags & SLAB_LOCK) && 0 > mlock (base, len)) {
+        LOG ("mlock(%zu) failed : (%d) %s", len, errno, strerror (errno));
+        s->flags &= ~SLAB_LOCK;
+    }
+
+    struct slab_arena_s *a = (struct slab_arena_s *) base;
+
+    a->free = NULL;
+    a->fresh = base + HEADER;
+    a->used = 0;
+    _list (&s->partial, a);
+    s->capacity += s->per_arena;
+    ++s->stats->arenas;
+    ++s->stats->maps;
+    s->stats->bytes += len;
+    return a;
+}
+
+static void
+_arena_unmap (struct slab_s *s, struct slab_arena_s **head,
+    struct slab_arena_s *a)
+{
+    _unlist (head, a);
+    munmap (a, s->arena_size);
+    s->capacity -= s->per_arena;
+    --s->stats->arenas;
+    ++s->stats->unmaps;
+    s->stats->bytes -= s->arena_size;
+}
+
+void
+slab_fini (struct slab_s *s)
+{
+    struct slab_arena_s **heads[2] = { &s->partial, &s->full };
+
+    for (int i = 0; i < 2; ++i) {
+        while (*heads[i]) {
+            s->stats->objects -= (*heads[i])->used;
+            _arena_unmap (s, heads[i], *heads[i]);
+        }
+    }
+    s->used = 0;
+}
+
+int
+slab_reserve (struct slab_s *s, unsigned int count)
+{
+    s->reserve = count;
+    while (s->capacity < count) {
+        if (!_arena_map (s, 1))
+            return 0;
+    }
+    return 1;
+}
+
+void *
+slab_alloc (struct slab_s *s)
+{
+    struct slab_arena_s *a = s->partial;
+    void *p;
+
+    if (!a && !(a = _arena_map (s, 0)))
+        return NULL;
+    if (a->free) {
+        p = a->free;
+        a->free = *(void **) p;
+        memset (p, 0, s->size);
+    }
+    else {
+        // Fresh from the mapping, already zeroed
+        p = a->fresh;
+        a->fresh += s->size;
+    }
+    if (++a->used == s->per_arena) {
+        _unlist (&s->partial, a);
+        _list (&s->full, a);
+    }
+    ++s->used;
+    ++s->stats->objects;
+    return p;
+}
+
+void
+slab_free (struct slab_s *s, void *p)
+{
+    struct slab_arena_s *a;
+
+    if (!p)
+        return;
+    if (s->fini)
+        s->fini (p);
+    a = ARENA (s, p);
+    *(void **) p = a->free;
+    a->free = p;
+    if (a->used-- == s->per_arena) {
+        _unlist (&s->full, a);
+        _list (&s->partial, a);
+    }
+    --s->used;
+    --s->stats->objects;
+    // The lists of idle objects already smooth the bursts, an empty
+    // arena is returned at once, the reserve aside.
+    if (!a->used && s->capacity - s->per_arena >= s->reserve)
+        _arena_unmap (s, &s->partial, a);
+}
@@ -0,0 +1,70 @@
+#ifndef LB_SLAB_H
+#define LB_SLAB_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Objects of a single size, cache-line aligned, carved from arenas mapped
+// apart from the heap. An arena is aligned on its own size, so that the
+// arena of an object is found by masking its address, and it is unmapped
+// as soon as none of its objects is in use, unless the slab keeps it to
+// honor its reserve. A slab belongs to a single event loop, nothing is
+// locked.
+// In front of each slab, the ACQUIRE_STRUCT macros of utils.h keep a list
+// of idle objects, still initialized, bounded by the watermarks below.
+
+#define SLAB_ALIGN    64
+#define SLAB_OBJECTS  64        // in an arena, at least
+#define SLAB_HUGEPAGE (2 * 1024 * 1024)
+
+#define SLAB_HUGE 0x01          // arenas of a hugepage, MAP_HUGETLB or THP
+#define SLAB_LOCK 0x02          // arenas locked in memory
+
+// Shared by the slabs of an event loop
+struct slab_stats_s
+{
+    uint64_t arenas;            // mapped
+    uint64_t bytes;             // mapped
+    uint64_t objects;           // in use, idle ones too
+    uint64_t idle;              // in the lists of idle objects
+    uint64_t maps;
+    uint64_t unmaps;
+    uint64_t huge_fallbacks;    // MAP_HUGETLB failed, THP asked instead
+};
+
+struct slab_arena_s;
+
+struct slab_s
+{
+    struct slab_arena_s *partial;       // with free objects
+    struct slab_arena_s *full;
+    struct slab_stats_s *stats;
+    void (*fini) (void *p);     // before an idle object is freed
+    size_t size;                // of the objects, aligned
+    size_t arena_size;
+    unsigned int per_arena;
+    unsigned int capacity;      // objects in the arenas mapped
+    unsigned int used;
+    unsigned int reserve;       // objects kept mapped
+    unsigned int idle;          // see the ACQUIRE_STRUCT macros
+    unsigned int idle_high, idle_low;
+    int flags;
+};
+
+void slab_init (struct slab_s *s, size_t size, int flags,
+    struct slab_stats_s *stats, void (*fini) (void *p));
+
+// Unmap all the arenas, the objects still in use included
+void slab_fini (struct slab_s *s);
+
+// Keep at least <count> objects mapped, and fault their pages in now so
+// that the first allocations do not stall. Returns 0 on error.
+int slab_reserve (struct slab_s *s, unsigned int count);
+
+// A zeroed object, or NULL on error
+void *slab_alloc (struct slab_s *s);
+
+// <fini> is called first, if set
+void slab_free (struct slab_s *s, void *p);
+
+#endif
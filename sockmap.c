@@ -0,0 +1,276 @@
+#include <stddef.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "./utils.h"
+#include "./sockmap.h"
+
+#ifndef SO_COOKIE
+#define SO_COOKIE 57
+#endif
+
+#define INSN(c,d,s,o,i) ((struct bpf_insn) { \
+        .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV_REG(d,s)     INSN (BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV_IMM(d,i)     INSN (BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ADD_IMM(d,i)     INSN (BPF_ALU64 | BPF_ADD | BPF_K, d, 0, 0, i)
+#define LDX(sz,d,s,o)    INSN (BPF_LDX | (sz) | BPF_MEM, d, s, o, 0)
+#define STX(sz,d,s,o)    INSN (BPF_STX | (sz) | BPF_MEM, d, s, o, 0)
+#define XADD64(d,s,o)    INSN (BPF_STX | BPF_DW | BPF_ATOMIC, d, s, o, BPF_ADD)
+#define JEQ_IMM(d,i,o)   INSN (BPF_JMP | BPF_JEQ | BPF_K, d, 0, o, i)
+#define JNE_IMM(d,i,o)   INSN (BPF_JMP | BPF_JNE | BPF_K, d, 0, o, i)
+#define CALL(f)          INSN (BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT()           INSN (BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP(d,fd)     INSN (BPF_LD | BPF_DW | BPF_IMM, d, \
+        BPF_PSEUDO_MAP_FD, 0, fd), INSN (0, 0, 0, 0, 0)
+
+static int
+_bpf (int cmd, union bpf_attr *attr)
+{
+    return syscall (__NR_bpf, cmd, attr, sizeof (*attr));
+}
+
+static int
+_map (enum bpf_map_type type, unsigned int ksize, unsigned int vsize,
+    unsigned int max, unsigned int flags)
+{
+    union bpf_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.map_type = type;
+    attr.key_size = ksize;
+    attr.value_size = vsize;
+    attr.max_entries = max;
+    attr.map_flags = flags;
+    return _bpf (BPF_MAP_CREATE, &attr);
+}
+
+static int
+_load (const struct bpf_insn *insns, unsigned int count)
+{
+    union bpf_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attr.insns = (uint64_t) (uintptr_t) insns;
+    attr.insn_cnt = count;
+    attr.license = (uint64_t) (uintptr_t) "Dual MIT/GPL";
+    return _bpf (BPF_PROG_LOAD, &attr);
+}
+
+static int
+_attach (int map, int prog, enum bpf_attach_type type)
+{
+    union bpf_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.target_fd = map;
+    attr.attach_bpf_fd = prog;
+    attr.attach_type = type;
+    return _bpf (BPF_PROG_ATTACH, &attr);
+}
+
+static int
+_update (int map, const void *key, const void *value)
+{
+    union bpf_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t) (uintptr_t) key;
+    attr.value = (uint64_t) (uintptr_t) value;
+    attr.flags = BPF_ANY;
+    return _bpf (BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int
+_lookup (int map, const void *key, void *value)
+{
+    union bpf_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t) (uintptr_t) key;
+    attr.value = (uint64_t) (uintptr_t) value;
+    return _bpf (BPF_MAP_LOOKUP_ELEM, &attr);
+}
+
+static void
+_delete (int map, const void *key)
+{
+    union bpf_attr attr;
+
+    memset (&attr, 0, sizeof (attr));
+    attr.map_fd = map;
+    attr.key = (uint64_t) (uintptr_t) key;
+    _bpf (BPF_MAP_DELETE_ELEM, &attr);
+}
+
+// The verdict, for a socket S receiving an skb:
+//   SK_DROP if the skb is empty, a FIN: its socket already knows, and
+//   an empty skb queued to either socket would fail its backlog
+//   peer = peers[cookie (S)], or SK_PASS if S is not linked yet
+//   SK_PASS unless bpf_sk_redirect_hash (skb, socks, &peer->cookie, 0)
+//   peer->bytes += skb->len, only once redirected
+// A redirection that fails leaves the data to S itself, to be noticed,
+// since dropping it would silently corrupt the stream.
+static int
+_load_verdict (struct sockmap_s *m)
+{
+    const struct bpf_insn insns[] = {
+        MOV_REG (BPF_REG_6, BPF_REG_1),
+        LDX (BPF_W, BPF_REG_2, BPF_REG_1, offsetof (struct __sk_buff, len)),
+        JNE_IMM (BPF_REG_2, 0, 2),
+        MOV_IMM (BPF_REG_0, SK_DROP),
+        EXIT (),
+        CALL (BPF_FUNC_get_socket_cookie),
+        STX (BPF_DW, BPF_REG_10, BPF_REG_0, -8),
+        LD_MAP (BPF_REG_1, m->peers),
+        MOV_REG (BPF_REG_2, BPF_REG_10),
+        ADD_IMM (BPF_REG_2, -8),
+        CALL (BPF_FUNC_map_lookup_elem),
+        JEQ_IMM (BPF_REG_0, 0, 11),
+        MOV_REG (BPF_REG_7, BPF_REG_0),
+        MOV_REG (BPF_REG_1, BPF_REG_6),
+        LD_MAP (BPF_REG_2, m->socks),
+        MOV_REG (BPF_REG_3, BPF_REG_7),
+        MOV_IMM (BPF_REG_4, 0),
+        CALL (BPF_FUNC_sk_redirect_hash),
+        JNE_IMM (BPF_REG_0, SK_PASS, 3),
+        LDX (BPF_W, BPF_REG_1, BPF_REG_6, offsetof (struct __sk_buff, len)),
+        XADD64 (BPF_REG_7, BPF_REG_1, offsetof (struct sockmap_peer_s,
+                bytes)),
+        EXIT (),
+        MOV_IMM (BPF_REG_0, SK_PASS),
+        EXIT (),
+    };
+
+    return _load (insns, sizeof (insns) / sizeof (insns[0]));
+}
+
+// Each skb is a message of its own, for the kernels that need a parser
+static int
+_load_parser (void)
+{
+    const struct bpf_insn insns[] = {
+        LDX (BPF_W, BPF_REG_0, BPF_REG_1, offsetof (struct __sk_buff, len)),
+        EXIT (),
+    };
+
+    return _load (insns, sizeof (insns) / sizeof (insns[0]));
+}
+
+int
+sockmap_init (struct sockmap_s *m, unsigned int max)
+{
+    int err;
+
+    m->verdict = m->parser = m->peers = -1;
+    if (0 > (m->socks = _map (BPF_MAP_TYPE_SOCKHASH, sizeof (uint64_t),
+                sizeof (uint32_t), max, 0)))
+        goto fail;
+    if (0 > (m->peers = _map (BPF_MAP_TYPE_HASH, sizeof (uint64_t),
+                sizeof (struct sockmap_peer_s), max, BPF_F_NO_PREALLOC)))
+        goto fail;
+    if (0 > (m->verdict = _load_verdict (m)))
+        goto fail;
+    // Linux >= 5.13 runs the verdict on each skb, without a parser
+    if (0 == _attach (m->socks, m->verdict, BPF_SK_SKB_VERDICT))
+        return 0;
+    if (0 > (m->parser = _load_parser ()))
+        goto fail;
+    if (0 > _attach (m->socks, m->parser, BPF_SK_SKB_STREAM_PARSER)
+        || 0 > _attach (m->socks, m->verdict, BPF_SK_SKB_STREAM_VERDICT))
+        goto fail;
+    return 0;
+
+fail:
+    err = errno;
+    sockmap_fini (m);
+    errno = err;
+    return -1;
+}
+
+void
+sockmap_fini (struct sockmap_s *m)
+{
+    int *fds[4] = { &m->verdict, &m->parser, &m->peers, &m->socks };
+
+    for (int i = 0; i < 4; ++i) {
+        if (*fds[i] >= 0)
+            close (*fds[i]);
+        *fds[i] = -1;
+    }
+}
+
+uint64_t
+sockmap_cookie (int fd)
+{
+    uint64_t cookie = 0;
+    socklen_t len = sizeof (cookie);
+
+    if (0 > getsockopt (fd, SOL_SOCKET, SO_COOKIE, &cookie, &len))
+        return 0;
+    return cookie;
+}
+
+uint64_t
+sockmap_written (int fd)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof (ti);
+    int queued = 0;
+
+    memset (&ti, 0, sizeof (ti));
+    if (0 > getsockopt (fd, IPPROTO_TCP, TCP_INFO, &ti, &len)
+        || 0 > ioctl (fd, SIOCOUTQ, &queued))
+        return 0;
+    return ti.tcpi_bytes_acked + queued;
+}
+
+int
+sockmap_established (int fd)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof (ti);
+
+    if (0 > getsockopt (fd, IPPROTO_TCP, TCP_INFO, &ti, &len))
+        return 0;
+    return ti.tcpi_state == BPF_TCP_ESTABLISHED;
+}
+
+int
+sockmap_add (struct sockmap_s *m, int fd, uint64_t cookie)
+{
+    uint32_t value = fd;
+
+    return _update (m->socks, &cookie, &value);
+}
+
+int
+sockmap_link (struct sockmap_s *m, uint64_t cookie, uint64_t peer)
+{
+    struct sockmap_peer_s value = {.cookie = peer,.bytes = 0 };
+
+    return _update (m->peers, &cookie, &value);
+}
+
+uint64_t
+sockmap_bytes (struct sockmap_s *m, uint64_t cookie)
+{
+    struct sockmap_peer_s value;
+
+    if (0 > _lookup (m->peers, &cookie, &value))
+        return 0;
+    return value.bytes;
+}
+
+void
+sockmap_del (struct sockmap_s *m, uint64_t cookie)
+{
+    _delete (m->peers, &cookie);
+    _delete (m->socks, &cookie);
+}
@@ -0,0 +1,55 @@
+#ifndef LB_SOCKMAP_H
+#define LB_SOCKMAP_H 1
+
+#include <stdint.h>
+
+// In-kernel forwarding between the two sockets of a tunnel, through a
+// sockhash and an sk_skb verdict program, on top of the raw bpf() system
+// call so that we don't depend on libbpf. The sockets are keyed by their
+// cookie, and the program redirects what a socket receives to the egress
+// of its peer, counting the bytes. One set of maps is owned by one event
+// loop, there is no locking at all.
+
+struct sockmap_s
+{
+    int socks;                  // sockhash, cookie -> socket
+    int peers;                  // hash, cookie -> struct sockmap_peer_s
+    int verdict;
+    int parser;                 // only on kernels without BPF_SK_SKB_VERDICT
+};
+
+struct sockmap_peer_s
+{
+    uint64_t cookie;
+    uint64_t bytes;             // redirected to the peer, by the program
+};
+
+// Create the maps for <max> sockets and attach the programs. Returns 0,
+// or -1 with errno set, e.g. EPERM when unprivileged.
+int sockmap_init (struct sockmap_s *m, unsigned int max);
+
+void sockmap_fini (struct sockmap_s *m);
+
+// The cookie of the socket, 0 on error
+uint64_t sockmap_cookie (int fd);
+
+// The bytes written to the socket so far, acknowledged or still queued
+uint64_t sockmap_written (int fd);
+
+// Whether the socket may be inserted, i.e. is established and received
+// no FIN yet
+int sockmap_established (int fd);
+
+// Insert the socket. The program passes what it receives to the socket
+// itself until its peer is set with sockmap_link(). Returns 0 or -1.
+int sockmap_add (struct sockmap_s *m, int fd, uint64_t cookie);
+
+// Start redirecting what <cookie> receives to <peer>. Returns 0 or -1.
+int sockmap_link (struct sockmap_s *m, uint64_t cookie, uint64_t peer);
+
+// The bytes redirected from <cookie> so far
+uint64_t sockmap_bytes (struct sockmap_s *m, uint64_t cookie);
+
+void sockmap_del (struct sockmap_s *m, uint64_t cookie);
+
+#endif
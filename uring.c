@@ -0,0 +1,154 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+#include "./utils.h"
+#include "./uring.h"
+
+static int
+_setup (unsigned int entries, struct io_uring_params *p)
+{
+    return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+_enter (int fd, unsigned int submit, unsigned int wait, unsigned int flags,
+    void *arg, size_t argsz)
+{
+    return syscall (__NR_io_uring_enter, fd, submit, wait, flags, arg,
+        argsz);
+}
+
+int
+uring_init (struct uring_s *r, unsigned int entries)
+{
+    struct io_uring_params p;
+
+    memset (r, 0, sizeof (*r));
+    memset (&p, 0, sizeof (p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+    p.cq_entries = entries * 4;
+    if (0 > (r->fd = _setup (entries, &p)))
+        return -1;
+    r->features = p.features;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    r->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof (struct io_uring_cqe);
+    if (r->features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap (NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+        goto error;
+    if (r->features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ring = r->sq_ring;
+    else {
+        r->cq_ring = mmap (NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED)
+            goto error;
+    }
+
+    r->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+    r->sqes = mmap (NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto error;
+
+    r->sq_head = (unsigned int *) ((char *) r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned int *) ((char *) r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned int *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *) ((char *) r->sq_ring + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned int *) ((char *) r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned int *) ((char *) r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned int *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+
+    // The SQ indirection array is used as an identity mapping
+    for (unsigned int i = 0; i < r->sq_entries; ++i)
+        r->sq_array[i] = i;
+    return 0;
+
+error:
+    uring_fini (r);
+    return -1;
+}
+
+void
+uring_fini (struct uring_s *r)
+{
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap (r->sqes, r->sqes_size);
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+        munmap (r->cq_ring, r->cq_ring_size);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED)
+        munmap (r->sq_ring, r->sq_ring_size);
+    if (r->fd >= 0)
+        close (r->fd);
+    memset (r, 0, sizeof (*r));
+    r->fd = -1;
+}
+
+static int
+_submit (struct uring_s *r, unsigned int wait, unsigned int flags,
+    void *arg, size_t argsz)
+{
+    unsigned int submit = r->sq_pending;
+    int rc;
+
+    if (submit)
+        __atomic_store_n (r->sq_tail, *r->sq_tail + submit, __ATOMIC_RELEASE);
+    r->sq_pending = 0;
+retry:
+    rc = _enter (r->fd, submit, wait, flags | (wait ? IORING_ENTER_GETEVENTS :
+            0), arg, argsz);
+    if (rc < 0 && errno == EINTR && submit == 0 && running)
+        goto retry;
+    return rc;
+}
+
+struct io_uring_sqe *
+uring_sqe (struct uring_s *r)
+{
+    unsigned int head = __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *r->sq_tail + r->sq_pending;
+
+    if (tail - head >= r->sq_entries) {
+        if (0 > _submit (r, 0, 0, NULL, 0))
+            return NULL;
+        head = __atomic_load_n (r->sq_head, __ATOMIC_ACQUIRE);
+        tail = *r->sq_tail;
+        if (tail - head >= r->sq_entries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = r->sqes + (tail & *r->sq_mask);
+
+    memset (sqe, 0, sizeof (*sqe));
+    ++r->sq_pending;
+    return sqe;
+}
+
+int
+uring_enter (struct uring_s *r, int to)
+{
+    if (to < 0)
+        return _submit (r, 1, 0, NULL, 0);
+    if (to == 0)
+        return r->sq_pending ? _submit (r, 0, 0, NULL, 0) : 0;
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    ts.tv_sec = to / 1000;
+    ts.tv_nsec = (to % 1000) * 1000000;
+    memset (&arg, 0, sizeof (arg));
+    arg.ts = (uint64_t) (uintptr_t) & ts;
+    return _submit (r, 1, IORING_ENTER_EXT_ARG, &arg, sizeof (arg));
+}
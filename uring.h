@@ -0,0 +1,57 @@
+#ifndef LB_URING_H
+#define LB_URING_H 1
+
+#include <linux/io_uring.h>
+
+// Minimal io_uring wrapper, on top of the raw system calls, so that we
+// don't depend on liburing. One ring is owned by one event loop, there
+// is no locking at all.
+
+struct uring_s
+{
+    int fd;
+    unsigned int features;
+
+    // Submission queue
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int sq_entries, sq_pending;
+    struct io_uring_sqe *sqes;
+
+    // Completion queue
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+int uring_init (struct uring_s *r, unsigned int entries);
+void uring_fini (struct uring_s *r);
+
+// Return a zeroed submission entry, submitting the pending entries
+// first if the queue is full.
+struct io_uring_sqe *uring_sqe (struct uring_s *r);
+
+// Submit the pending entries then wait for at least one completion, for
+// at most <to> milliseconds (0 to not wait, -1 to wait forever).
+int uring_enter (struct uring_s *r, int to);
+
+// Iterate on the completions ready: each call to uring_cqe() must be
+// followed by uring_cqe_seen() when the entry has been consumed.
+static inline struct io_uring_cqe *
+uring_cqe (struct uring_s *r)
+{
+    unsigned int head = *r->cq_head;
+
+    if (head == __atomic_load_n (r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return r->cqes + (head & *r->cq_mask);
+}
+
+static inline void
+uring_cqe_seen (struct uring_s *r)
+{
+    __atomic_store_n (r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
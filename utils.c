@@ -1,8 +1,14 @@
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
 #include <netinet/tcp.h>
 #include "./utils.h"
 
 uint32_t main_flags = 0;
 volatile int running = 1;
+unsigned int main_workers = 0;
+__thread unsigned int main_worker_id = 0;
+int (*main_option) (const char *name, const char *value) = NULL;
 
 #define _freopen(to,mode,what) do { \
 	what = freopen(to, mode, what); \
@@ -30,13 +36,29 @@ main_init (int argc, char **argv)
     _freopen ("/dev/null", "r", stdin);
     main_flags = 0;
 
-    int first_positional = 1;
+    int first_positional = argc;
 
     for (int i = 1; i < argc; ++i) {
         if (!strcmp (argv[i], "-f"))
             main_flags |= MF_FORK;
         else if (!strcmp (argv[i], "-d"))
             main_flags |= MF_DAEMONIZE_WANTED;
+        else if (!strcmp (argv[i], "-t"))
+            main_flags |= MF_FORK | MF_THREADS;
+        else if (!strcmp (argv[i], "-w") && i + 1 < argc) {
+            main_flags |= MF_FORK;
+            main_workers = atoi (argv[++i]);
+        }
+        else if (!strcmp (argv[i], "-o") && i + 1 < argc) {
+            char *name = argv[++i], *eq = strchr (name, '=');
+
+            if (eq)
+                *(eq++) = '\0';
+            if (!main_option || !(*main_option) (name, eq ? eq : "1")) {
+                LOG ("Invalid option [%s]", name);
+                exit (1);
+            }
+        }
         else {
             first_positional = i;
             break;
@@ -56,11 +78,186 @@ main_init (int argc, char **argv)
     return argv + first_positional;
 }
 
+// Pin the calling thread (or process) on the CPU matching its rank,
+// among those it is allowed to run on.
+static void
+_worker_pin (unsigned int rank)
+{
+    cpu_set_t set;
+    int count;
+
+    if (0 != sched_getaffinity (0, sizeof (set), &set))
+        return;
+    if (0 >= (count = CPU_COUNT (&set)))
+        return;
+    rank %= count;
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+        if (CPU_ISSET (i, &set) && !(rank--)) {
+            CPU_ZERO (&set);
+            CPU_SET (i, &set);
+            sched_setaffinity (0, sizeof (set), &set);
+            return;
+        }
+    }
+}
+
+struct worker_s
+{
+    pthread_t th;
+    unsigned int rank;
+    void (*run) ();
+};
+
+static void *
+_worker_thread (void *p)
+{
+    struct worker_s *w = p;
+
+    main_worker_id = w->rank;
+    _worker_pin (w->rank);
+    (*w->run) ();
+    return NULL;
+}
+
+static void
+_run_threads (void (*run) ())
+{
+    struct worker_s *workers = calloc (main_workers, sizeof (*workers));
+    sigset_t stop, old;
+
+    ASSERT (workers != NULL);
+
+    // Only the main thread handles the termination signals, the workers
+    // are then woken up with SIGUSR1 to let them notice the end.
+    sigemptyset (&stop);
+    sigaddset (&stop, SIGINT);
+    sigaddset (&stop, SIGTERM);
+    pthread_sigmask (SIG_BLOCK, &stop, &old);
+
+    for (unsigned int i = 0; i < main_workers; ++i) {
+        workers[i].rank = i;
+        workers[i].run = run;
+        if (0 != pthread_create (&workers[i].th, NULL, _worker_thread,
+                workers + i)) {
+            LOG ("pthread_create() failed : (%d) %s", errno, strerror (errno));
+            running = 0;
+            main_workers = i;
+            break;
+        }
+    }
+
+    sigdelset (&old, SIGINT);
+    sigdelset (&old, SIGTERM);
+    while (running)
+        sigsuspend (&old);
+
+    for (unsigned int i = 0; i < main_workers; ++i) {
+        struct timespec ts;
+
+        do {
+            pthread_kill (workers[i].th, SIGUSR1);
+            clock_gettime (CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_nsec -= 1000000000;
+                ++ts.tv_sec;
+            }
+        } while (ETIMEDOUT == pthread_timedjoin_np (workers[i].th, NULL, &ts));
+    }
+    free (workers);
+}
+
+static void
+_run_processes (void (*run) ())
+{
+    int *children = calloc (main_workers, sizeof (int));
+    unsigned int count_children = 0, kill_sent = 0;
+    sigset_t wake, old;
+
+    ASSERT (children != NULL);
+
+    // Like with the threads, the parent takes the termination signals
+    // synchronously: a handler would only restart waitpid().
+    sigemptyset (&wake);
+    sigaddset (&wake, SIGINT);
+    sigaddset (&wake, SIGTERM);
+    sigaddset (&wake, SIGCHLD);
+    sigprocmask (SIG_BLOCK, &wake, &old);
+
+    for (unsigned int i = 0; i < main_workers; ++i) {
+        children[i] = fork ();
+        if (children[i] < 0) {
+            LOG ("fork() failed : (%d) %s", errno, strerror (errno));
+        }
+        else if (children[i] == 0) {    // break;
+            free (children);
+            sigprocmask (SIG_SETMASK, &old, NULL);
+            main_worker_id = i;
+            _worker_pin (i);
+            return (*run) ();
+        }
+        else {
+            ++count_children;
+        }
+    }
+
+    while (count_children > 0) {
+
+        if (!running && !kill_sent) {
+            kill_sent = 1;
+            for (unsigned int i = 0; i < main_workers; ++i) {
+                if (children[i] > 0)
+                    kill (children[i], SIGTERM);
+            }
+        }
+
+        int pid, prc = 0;
+
+        pid = waitpid (0, &prc, WNOHANG);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pid == 0) {
+            int s = sigwaitinfo (&wake, NULL);
+
+            if (s == SIGINT || s == SIGTERM)
+                running = 0;
+            continue;
+        }
+        LOG ("Child exited [%d] with RC [%d]", pid, prc);
+        --count_children;
+        for (unsigned int i = 0; i < main_workers; ++i) {
+            if (children[i] && pid == children[i]) {
+                children[i] = 0;
+            }
+        }
+    }
+    sigprocmask (SIG_SETMASK, &old, NULL);
+    free (children);
+}
+
+unsigned int
+main_count_workers (void)
+{
+    if (!(main_flags & MF_FORK))
+        return main_workers = 1;
+
+    // By default, one event loop per available CPU
+    if (!main_workers) {
+        long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+        main_workers = (n > 0) ? n : 1;
+    }
+    if (main_workers > MAXWORKERS)
+        main_workers = MAXWORKERS;
+    return main_workers;
+}
+
 void
 main_run (void (*run) ())
 {
-    int children[MAXCHLD], count_children = 0, kill_sent = 0;
-
     _freopen ("/dev/null", "a", stdout);
     if (main_flags & MF_DAEMONIZE_WANTED) {
         if (0 > daemon (1, 0)) {
@@ -73,75 +270,234 @@ main_run (void (*run) ())
         }
     }
 
+    main_count_workers ();
     if (!(main_flags & MF_FORK))
         return (*run) ();
-    else {
-        for (int i = 0; i < MAXCHLD; ++i) {
-            children[i] = fork ();
-            if (children[i] < 0) {
-                LOG ("fork() failed : (%d) %s", errno, strerror (errno));
-            }
-            else if (children[i] == 0) {    // break;
-                memset (children, 0, sizeof (children));
-                return (*run) ();
-            }
-            else {
-                ++count_children;
-            }
-        }
 
-        while (count_children > 0) {
-
-            if (!running && !kill_sent) {
-                kill_sent = 1;
-                for (int i = 0; i < 0; ++i) {
-                    if (children[i] != 0)
-                        kill (children[i], SIGTERM);
-                }
-            }
-
-            int pid, prc = 0;
-
-            pid = waitpid (0, &prc, 0);
-            if (pid < 0)
-                break;
-            LOG ("Child exited [%d] with RC [%d]", pid, prc);
-            --count_children;
-            for (int i = 0; i < MAXCHLD; ++i) {
-                if (children[i] && pid == children[i]) {
-                    children[i] = 0;
-                }
-            }
-        }
-    }
+    if (main_flags & MF_THREADS)
+        return _run_threads (run);
+    return _run_processes (run);
 }
 
 int
-sockaddr_init (struct sockaddr *sa, char *url)
+sockaddr_parse (struct sockaddr *sa, const char *url, size_t len)
 {
+    char buf[64], *colon;
     int rc;
-    char *colon;
 
     memset (sa, 0, sizeof (struct sockaddr_in6));
-    if (!(colon = strrchr (url, ':')))
+    if (len >= sizeof (buf))
+        return 0;
+    memcpy (buf, url, len);
+    buf[len] = '\0';
+
+    if (!(colon = strrchr (buf, ':')) || colon == buf)
         return 0;
     *colon = '\0';
     if (*(colon - 1) == ']') {
+        if (buf[0] != '[')
+            return 0;
         *(colon - 1) = 0;
         S6FAM (sa) = AF_INET6;
         S6PRT (sa) = htons (atoi (colon + 1));
-        rc = inet_pton (AF_INET6, url + 1, S6BUF (sa));
-        *(colon - 1) = ']';
+        rc = inet_pton (AF_INET6, buf + 1, S6BUF (sa));
     }
     else {
         S4FAM (sa) = AF_INET;
         S4PRT (sa) = htons (atoi (colon + 1));
-        rc = inet_pton (AF_INET, url, S4BUF (sa));
+        rc = inet_pton (AF_INET, buf, S4BUF (sa));
     }
-    *colon = ':';
     return (rc == 1);
 }
 
+int
+sockaddr_init (struct sockaddr *sa, const char *url)
+{
+    return sockaddr_parse (sa, url, strlen (url));
+}
+
+// Walk the records of a binary message without decoding them. Returns 0
+// if they match the count of the header, or -1 with <*bad> at the fault.
+static int
+_token_check (const uint8_t * b, size_t len, size_t *bad)
+{
+    unsigned int count = ((unsigned int) b[2] << 8) | b[3];
+    size_t off = TOKEN_HEADER;
+
+    for (; off < len; --count) {
+        uint8_t type = b[off];
+        size_t rlen = 4 + (((type & TOKEN_FAMILY) == 6) ? 16 : 4)
+            + ((type & TOKEN_EXT) ? 6 : 0);
+
+        if (!count || ((type & TOKEN_FAMILY) != 4
+                && (type & TOKEN_FAMILY) != 6) || off + rlen > len) {
+            *bad = off;
+            return -1;
+        }
+        off += rlen;
+    }
+    if (count) {
+        *bad = len;
+        return -1;
+    }
+    return 0;
+}
+
+int
+token_decode (const void *msg, size_t len, size_t *off, struct token_s *tok)
+{
+    const uint8_t *b = msg, *end = b + len;
+
+    memset (tok, 0, sizeof (*tok));
+    if (*off >= len)
+        return 0;
+
+    // Legacy textual form, one address per message
+    if (b[0] != TOKEN_MAGIC) {
+        *off = len;
+        return sockaddr_parse (SA (&tok->addr), msg, len) ? 1 : -1;
+    }
+
+    if (*off == 0) {
+        if (len < TOKEN_HEADER || b[1] != TOKEN_VERSION)
+            return -1;
+        if (0 > _token_check (b, len, off))
+            return -1;
+        *off = TOKEN_HEADER;
+    }
+
+    b += *off;
+    if (b + 4 > end)
+        return -1;
+
+    uint8_t type = b[0];
+    size_t alen = ((type & TOKEN_FAMILY) == 6) ? 16 : 4;
+    size_t rlen = 4 + alen + ((type & TOKEN_EXT) ? 6 : 0);
+
+    if ((type & TOKEN_FAMILY) != 4 && (type & TOKEN_FAMILY) != 6)
+        return -1;
+    if (b + rlen > end)
+        return -1;
+
+    // The port is kept in network order
+    if (alen == 4) {
+        S4FAM (&tok->addr) = AF_INET;
+        memcpy (&S4PRT (&tok->addr), b + 2, 2);
+        memcpy (S4BUF (&tok->addr), b + 4, 4);
+    }
+    else {
+        S6FAM (&tok->addr) = AF_INET6;
+        memcpy (&S6PRT (&tok->addr), b + 2, 2);
+        memcpy (S6BUF (&tok->addr), b + 4, 16);
+    }
+    if (type & TOKEN_EXT) {
+        const uint8_t *x = b + 4 + alen;
+
+        tok->id = ((uint32_t) x[0] << 24) | ((uint32_t) x[1] << 16)
+            | ((uint32_t) x[2] << 8) | x[3];
+        tok->weight = ((uint16_t) x[4] << 8) | x[5];
+    }
+    *off += rlen;
+    return 1;
+}
+
+int
+token_ring_init (struct token_ring_s *r, unsigned int size)
+{
+    unsigned int sz;
+
+    for (sz = 1; sz < size; sz <<= 1);
+    memset (r, 0, sizeof (*r));
+    if (!(r->tab = calloc (sz, sizeof (struct sockaddr_in6))))
+        return 0;
+    r->mask = sz - 1;
+    return 1;
+}
+
+int
+token_ring_fill (struct token_ring_s *r)
+{
+    const uint8_t *b = r->msg.buf;
+    struct token_s tok;
+    size_t at;
+    int rc;
+
+    while (TOKEN_RING_COUNT (r) < TOKEN_RING_SIZE (r)) {
+        at = r->msg.off;
+        rc = token_decode (r->msg.buf, r->msg.len, &at, &tok);
+        if (rc > 0) {
+            r->tab[(r->tail++) & r->mask] = tok.addr;
+            r->msg.off = at;
+            continue;
+        }
+        // The message is dropped, <at> points at the fault
+        if (rc < 0 && b[0] != TOKEN_MAGIC)
+            LOG ("invalid backend: [%.*s]",
+                (int) (r->msg.len < 64 ? r->msg.len : 64), (char *) b);
+        else if (rc < 0)
+            LOG ("invalid backend: token at offset %zu of a %zu-byte message"
+                " (type 0x%02x, %u announced)", at, r->msg.len,
+                at < r->msg.len ? b[at] : 0, r->msg.len >= TOKEN_HEADER ?
+                ((unsigned int) b[2] << 8 | b[3]) : 0);
+        return 0;
+    }
+    return r->msg.off < r->msg.len;
+}
+
+int
+token_ring_pop (struct token_ring_s *r, struct sockaddr_in6 *to)
+{
+    if (!TOKEN_RING_COUNT (r))
+        return 0;
+    *to = r->tab[(r->head++) & r->mask];
+    return 1;
+}
+
+static void
+_put32 (uint8_t * b, uint32_t v)
+{
+    b[0] = v >> 24;
+    b[1] = v >> 16;
+    b[2] = v >> 8;
+    b[3] = v;
+}
+
+void
+feedback_header (void *msg, unsigned int count, uint32_t sender)
+{
+    uint8_t *b = msg;
+
+    b[0] = FEEDBACK_MAGIC;
+    b[1] = FEEDBACK_VERSION;
+    b[2] = count >> 8;
+    b[3] = count;
+    _put32 (b + 4, sender);
+}
+
+size_t
+feedback_encode (void *dst, size_t dlen, const struct feedback_s *fb)
+{
+    uint8_t *b = dst;
+    size_t alen = (SAFAM (&fb->addr) == AF_INET) ? 4 : 16;
+
+    if (dlen < 4 + alen + 16)
+        return 0;
+    b[0] = (alen == 4) ? 4 : 6;
+    b[1] = 0;
+    // The port is kept in network order
+    if (alen == 4)
+        memcpy (b + 2, &S4PRT (&fb->addr), 2);
+    else
+        memcpy (b + 2, &S6PRT (&fb->addr), 2);
+    memcpy (b + 4, SABUF (&fb->addr), alen);
+    b += 4 + alen;
+    _put32 (b, fb->connects);
+    _put32 (b + 4, fb->failures);
+    _put32 (b + 8, fb->latency);
+    _put32 (b + 12, fb->active);
+    return 4 + alen + 16;
+}
+
 void
 sockaddr_dump (const struct sockaddr *sa, char *dst, size_t dlen)
 {
@@ -154,6 +510,24 @@ sockaddr_dump (const struct sockaddr *sa, char *dst, size_t dlen)
     }
 }
 
+uint64_t
+main_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t
+main_now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
 void
 main_log (char *fmt, ...)
 {
@@ -178,3 +552,14 @@ sock_set_chatty (int fd, int on)
     on = !on;
     setsockopt (fd, SOL_TCP, TCP_CORK, &on, sizeof (on));
 }
+
+int
+sock_get_error (int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof (err);
+
+    if (0 > getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) || !err)
+        return EIO;
+    return err;
+}
@@ -2,6 +2,7 @@
 #define LB_UTILS_H 1
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
@@ -19,10 +20,11 @@
 
 #define MF_DAEMONIZE_WANTED 0x01
 #define MF_FORK             0x02
+#define MF_THREADS          0x04
 #define MF_DAEMONIZED       0x10
 
 #define MAXEVT  64
-#define MAXCHLD 2
+#define MAXWORKERS 1024
 #define PIPE_SIZE 524288
 
 #ifdef HAVE_ASSERT
@@ -67,16 +69,22 @@
 #define DIRTY_STRUCT_NAME(T) DIRTY_##T
 #define ACTIVE_STRUCT_NAME(T) ACTIVE_##T
 
+#define SLAB_STRUCT_NAME(T) SLAB_##T
+
+// The structures are carved from the slab SLAB_STRUCT_NAME(T) (see slab.h)
+// and the idle ones are kept initialized in IDLE_STRUCT_NAME(T). Above
+// <idle_high> idle structures, the coldest are freed down to <idle_low>.
 #define ACQUIRE_STRUCT_CALL(T) acquire_##T()
 #define ACQUIRE_STRUCT_DECL(T) static T * acquire_##T () { \
 	T *_p; \
 	if (!(_p = IDLE_STRUCT_NAME(T))) { \
-		if (0 != posix_memalign((void**)&_p, sizeof(long long), sizeof(T))) \
+		if (!(_p = slab_alloc(&SLAB_STRUCT_NAME(T)))) \
 			abort(); \
-		memset(_p, 0, sizeof(T)); \
 	} else { \
 		IDLE_STRUCT_NAME(T) = _p->next; \
 		_p->next = NULL; \
+		--SLAB_STRUCT_NAME(T).idle; \
+		--SLAB_STRUCT_NAME(T).stats->idle; \
 	} return _p; \
 }
 
@@ -96,31 +104,169 @@
 	PREPEND_STRUCT(b1,_p); \
 } while (0)
 
+#define RELEASE_STRUCT_CALL(T,p) release_##T(p)
+#define RELEASE_STRUCT_DECL(T) static void release_##T (T *_p) { \
+	struct slab_s *_s = &SLAB_STRUCT_NAME(T); \
+	T **_pp = &IDLE_STRUCT_NAME(T); \
+	PREPEND_STRUCT(IDLE_STRUCT_NAME(T), _p); \
+	++_s->stats->idle; \
+	if (++_s->idle <= _s->idle_high) \
+		return; \
+	for (unsigned int _i = 0; _i < _s->idle_low; ++_i) \
+		_pp = (T **) &(*_pp)->next; \
+	while (*_pp) { \
+		SHIFT_STRUCT(*_pp, _p); \
+		slab_free(_s, _p); \
+	} \
+	_s->stats->idle -= _s->idle - _s->idle_low; \
+	_s->idle = _s->idle_low; \
+}
+
 #define DRAIN_STRUCT_CALL(T) recover_##T ()
 #define DRAIN_STRUCT_DECL(T) static inline void recover_##T () { \
-	while (DIRTY_STRUCT_NAME(T) != NULL) \
-		MOVE_STRUCT(T,DIRTY_STRUCT_NAME(T), IDLE_STRUCT_NAME(T)); \
+	while (DIRTY_STRUCT_NAME(T) != NULL) { \
+		T *_p; SHIFT_STRUCT(DIRTY_STRUCT_NAME(T),_p); \
+		release_##T(_p); \
+	} \
 }
 
 #define PURGE_STRUCT_CALL(T) purge_##T()
 #define PURGE_STRUCT_DECL(T) static inline void purge_##T () { \
 	while (IDLE_STRUCT_NAME(T) != NULL) { \
 		T *_p; SHIFT_STRUCT(IDLE_STRUCT_NAME(T),_p); \
-		free(_p); \
+		slab_free(&SLAB_STRUCT_NAME(T), _p); \
 	} \
+	SLAB_STRUCT_NAME(T).stats->idle -= SLAB_STRUCT_NAME(T).idle; \
+	SLAB_STRUCT_NAME(T).idle = 0; \
+	slab_fini(&SLAB_STRUCT_NAME(T)); \
 }
 
 //------------------------------------------------------------------------------
 
+// Binary form of the messages emitted by the generators, that carry a
+// batch of addresses. The legacy form is a single "IP:PORT" in text.
+//   header: magic(1) version(1) count(2, big endian)
+//   record: type(1) reserved(1) port(2, network order) addr(4|16)
+//           [id(4, big endian) weight(2, big endian)] if type & TOKEN_EXT
+// The family of the address (4 or 6) is in the low bits of the type.
+#define TOKEN_MAGIC   0xFB
+#define TOKEN_VERSION 1
+#define TOKEN_HEADER  4
+#define TOKEN_FAMILY  0x0F
+#define TOKEN_EXT     0x10
+
+struct token_s
+{
+    struct sockaddr_in6 addr;
+    uint32_t id;
+    uint16_t weight;
+};
+
+// Decode the token at <*off> in <msg>, whatever its form, and move <*off>
+// past it. Returns 1 if a token was decoded, 0 at the end of the
+// message and -1 if the message is malformed. A binary message is checked
+// as a whole when its header is read: a faulty record, trailing bytes or
+// a count of records that differs from the header rejects it entirely,
+// and <*off> is left at the fault (<len> for a missing record).
+int token_decode (const void *msg, size_t len, size_t *off,
+    struct token_s *tok);
+
+// The backends are prefetched from the feed of the generators into a ring
+// of addresses already parsed, so that a new client never implies a call
+// to nanomsg. The proxies receive the messages and the ring takes their
+// tokens: a message that carries more tokens than the room left in the
+// ring is kept until it is fully consumed.
+struct token_ring_s
+{
+    struct sockaddr_in6 *tab;
+    unsigned int head, tail, mask;
+    struct
+    {
+        void *buf;              // NULL when no message is held
+        size_t len, off;
+    } msg;
+};
+
+#define TOKEN_RING_COUNT(r) ((r)->tail - (r)->head)
+#define TOKEN_RING_SIZE(r)  ((r)->mask + 1)
+
+// Allocate at least <size> slots, rounded up to a power of 2. Returns 0
+// on error.
+int token_ring_init (struct token_ring_s *r, unsigned int size);
+
+// Take the tokens of the message held until the ring is full. Returns 1
+// if the message still has tokens, 0 once it is consumed or rejected, and
+// the caller may free it. A malformed message is logged, with the offset
+// and the type of the faulty record.
+int token_ring_fill (struct token_ring_s *r);
+
+// Returns 0 if the ring is empty
+int token_ring_pop (struct token_ring_s *r, struct sockaddr_in6 *to);
+
+// Binary form of the feedback the proxies push back to the generators,
+// one message per period from each event loop, with a record for each
+// backend it used during the period.
+//   header: magic(1) version(1) count(2) sender(4), big endian
+//   record: family(1) reserved(1) port(2, network order) addr(4|16)
+//           connects(4) failures(4) latency(4) active(4), big endian
+// The latency is the mean of the connects of the period, in microseconds,
+// and <active> the tunnels established toward the backend at the end of
+// the period. The sender is unique to the event loop.
+#define FEEDBACK_MAGIC   0xFC
+#define FEEDBACK_VERSION 1
+#define FEEDBACK_HEADER  8
+#define FEEDBACK_RECORD  (4 + 16 + 16)
+
+struct feedback_s
+{
+    struct sockaddr_in6 addr;
+    uint32_t connects;
+    uint32_t failures;
+    uint32_t latency;
+    uint32_t active;
+};
+
+void feedback_header (void *msg, unsigned int count, uint32_t sender);
+
+// Encode the record of <fb> in <dst>. Returns its length, or 0 if it
+// does not fit in <dlen> bytes.
+size_t feedback_encode (void *dst, size_t dlen, const struct feedback_s *fb);
+
+//------------------------------------------------------------------------------
+
 extern uint32_t main_flags;
 extern volatile int running;
 
-int sockaddr_init (struct sockaddr *sa, char *url);
+// Number of event loops started by main_run(), and the rank of the
+// current one. Both are only meaningful once main_run() started.
+extern unsigned int main_workers;
+extern __thread unsigned int main_worker_id;
+
+// Called by main_init() for each "-o NAME=VALUE" among the leading
+// options. It returns 0 if the option is unknown or its value invalid.
+extern int (*main_option) (const char *name, const char *value);
+
+int sockaddr_init (struct sockaddr *sa, const char *url);
+int sockaddr_parse (struct sockaddr *sa, const char *url, size_t len);
 void sockaddr_dump (const struct sockaddr *sa, char *dst, size_t dlen);
 void sock_set_chatty (int fd, int on);
 
+// Return the pending error of the socket (SO_ERROR), or EIO if unknown
+int sock_get_error (int fd);
+
 char **main_init (int argc, char **argv);
+
+// Resolve the number of event loops main_run() will start, it may be
+// called earlier to size what the workers share.
+unsigned int main_count_workers (void);
+
 void main_run (void (*run) ());
 void main_log (char *fmt, ...);
 
+// Monotonic clock, in milliseconds, cheap enough to be called on each loop
+uint64_t main_now (void);
+
+// Same as main_now(), in microseconds, precise but more expensive
+uint64_t main_now_us (void);
+
 #endif
@@ -0,0 +1,163 @@
+#include <string.h>
+
+#include "./wheel.h"
+
+static void
+_unlink (struct wheel_timer_s *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+static void
+_append (struct wheel_timer_s *head, struct wheel_timer_s *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+// Move all the timers of <slot> in the list <head>
+static void
+_detach (struct wheel_timer_s *slot, struct wheel_timer_s *head)
+{
+    head->next = head->prev = head;
+    if (slot->next == slot)
+        return;
+    head->next = slot->next;
+    head->prev = slot->prev;
+    head->next->prev = head;
+    head->prev->next = head;
+    slot->next = slot->prev = slot;
+}
+
+// Find the level where <t> belongs, relatively to the current time. The
+// expired timers go in the slot of the next tick to be processed.
+static void
+_place (struct wheel_s *w, struct wheel_timer_s *t)
+{
+    uint64_t delta, expire;
+    unsigned int level, idx;
+
+    expire = (t->expire > w->now) ? t->expire : w->now;
+    delta = expire - w->now;
+    for (level = 0; level < WHEEL_LEVELS - 1; ++level) {
+        if (delta < (1ULL << (WHEEL_BITS * (level + 1))))
+            break;
+    }
+    if (delta >= (1ULL << (WHEEL_BITS * WHEEL_LEVELS)))
+        expire = w->now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    idx = (expire >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    _append (&w->slots[level][idx], t);
+    w->used[level] |= 1ULL << idx;
+}
+
+static void
+_cascade (struct wheel_s *w, unsigned int level, unsigned int idx)
+{
+    struct wheel_timer_s head, *t;
+
+    _detach (&w->slots[level][idx], &head);
+    w->used[level] &= ~(1ULL << idx);
+    while ((t = head.next) != &head) {
+        _unlink (t);
+        _place (w, t);
+    }
+}
+
+void
+wheel_init (struct wheel_s *w, uint64_t now)
+{
+    memset (w, 0, sizeof (*w));
+    w->now = now;
+    for (unsigned int l = 0; l < WHEEL_LEVELS; ++l) {
+        for (unsigned int i = 0; i < WHEEL_SLOTS; ++i)
+            w->slots[l][i].next = w->slots[l][i].prev = &w->slots[l][i];
+    }
+}
+
+void
+wheel_add (struct wheel_s *w, struct wheel_timer_s *t, uint64_t expire)
+{
+    if (wheel_armed (t))
+        _unlink (t);
+    else
+        ++w->count;
+    t->expire = expire;
+    _place (w, t);
+}
+
+// The bit of the slot is left as is, it is cleared when the slot is found
+// empty while advancing the wheel.
+void
+wheel_del (struct wheel_s *w, struct wheel_timer_s *t)
+{
+    if (!wheel_armed (t))
+        return;
+    _unlink (t);
+    --w->count;
+}
+
+void
+wheel_advance (struct wheel_s *w, uint64_t now,
+    void (*expired) (struct wheel_timer_s *))
+{
+    struct wheel_timer_s head, *t;
+
+    while (w->now <= now) {
+        if (!w->count) {
+            w->now = now + 1;
+            return;
+        }
+
+        unsigned int idx = w->now & WHEEL_MASK;
+
+        if (!idx) {
+            for (unsigned int l = 1; l < WHEEL_LEVELS; ++l) {
+                unsigned int i = (w->now >> (WHEEL_BITS * l)) & WHEEL_MASK;
+
+                _cascade (w, l, i);
+                if (i)
+                    break;
+            }
+        }
+
+        // Skip the empty slots, up to the next cascade
+        uint64_t bits = w->used[0] >> idx;
+
+        if (!(bits & 1)) {
+            uint64_t next = bits ? w->now + __builtin_ctzll (bits)
+                : (w->now | WHEEL_MASK) + 1;
+
+            w->now = (next > now) ? now + 1 : next;
+            continue;
+        }
+
+        _detach (&w->slots[0][idx], &head);
+        w->used[0] &= ~(1ULL << idx);
+        ++w->now;
+        while ((t = head.next) != &head) {
+            _unlink (t);
+            --w->count;
+            expired (t);
+        }
+    }
+}
+
+int
+wheel_timeout (struct wheel_s *w)
+{
+    if (!w->count)
+        return -1;
+
+    unsigned int idx = w->now & WHEEL_MASK;
+    uint64_t bits = w->used[0] >> idx;
+
+    if (bits)
+        return __builtin_ctzll (bits) + 1;
+    // Up to the next cascade, that may be the next tick
+    return idx ? WHEEL_SLOTS - idx + 1 : 1;
+}
@@ -0,0 +1,56 @@
+#ifndef LB_WHEEL_H
+#define LB_WHEEL_H 1
+
+#include <stdint.h>
+
+// Hierarchical timing wheel, with a resolution of one millisecond. Adding
+// and removing a timer are O(1), and the timers are cascaded from a level
+// to the lower one as the time passes. The delays beyond the span of the
+// last level are clamped to it, the timer just expires late and has to
+// be rearmed by its owner. One wheel is owned by one event loop, there is
+// no locking at all.
+
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+struct wheel_timer_s
+{
+    struct wheel_timer_s *next, *prev;  // NULL when not armed
+    uint64_t expire;
+    unsigned int type;          // free for the owner of the timer
+};
+
+struct wheel_s
+{
+    uint64_t now;
+    unsigned int count;
+    uint64_t used[WHEEL_LEVELS];        // bitmaps of the non-empty slots
+    struct wheel_timer_s slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+void wheel_init (struct wheel_s *w, uint64_t now);
+
+// Arm <t> to expire at <expire>, it is first disarmed if necessary
+void wheel_add (struct wheel_s *w, struct wheel_timer_s *t, uint64_t expire);
+
+void wheel_del (struct wheel_s *w, struct wheel_timer_s *t);
+
+// Move the wheel to <now> and call <expired> on each timer expired, that
+// is already disarmed and can be rearmed from the callback.
+void wheel_advance (struct wheel_s *w, uint64_t now,
+    void (*expired) (struct wheel_timer_s *));
+
+// How many milliseconds until the wheel has to be advanced, -1 if no
+// timer is armed. It is a lower bound, when the next timer is in an upper
+// level the wheel is advanced just to cascade it.
+int wheel_timeout (struct wheel_s *w);
+
+static inline int
+wheel_armed (struct wheel_timer_s *t)
+{
+    return t->next != NULL;
+}
+
+#endif